@@ -1,22 +1,49 @@
 #pragma once
 #include <string>
-#include <random>
 #include <sstream>
 #include <map>
+#include <memory>
 #include <type_traits>
 #include <algorithm>
 #include "board.h"
 #include "action.h"
 #include "weight.h"
+#include "archive.h"
+#include "segment.h"
+#include "topology.h"
+#include "profiler.h"
+#include "rng.h"
+#include "transposition.h"
+#include "mcts.h"
+#include "book.h"
+#include "quantized.h"
 #include <fstream>
 #include <math.h>
 #include <list>
 #include <iterator>
 #include <queue>
+#include <cstdio>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <csignal>
+#include <unistd.h>
+#include <chrono>
+#include <cmath>
+#include <atomic>
+#include <thread>
+
+/**
+ * INTERLEAVE=1 (the default) evaluates the last two plies of the searches as
+ * pipelines that prefetch the weights of the next node before summing those
+ * of the current one; build with -DINTERLEAVE=0 for the plain recursion
+ */
+#ifndef INTERLEAVE
+#define INTERLEAVE 1
+#endif
 
 class agent{
 public:
-	agent(const std::string& args = "") : op_0({12, 13, 14, 15}), op_1({0, 4, 8, 12}), op_2({0, 1, 2, 3}), op_3({3, 7, 11, 15}){
+	agent(const std::string& args = "") {
 		std::stringstream ss("name=unknown role=unknown " + args);
 		for(std::string pair; ss >> pair; ) {
 			std::string key = pair.substr(0, pair.find('='));
@@ -45,10 +72,6 @@ protected:
 		operator numeric() const { return numeric(std::stod(value)); }
 	};
 	std::map<key, value> meta;
-	std::array<int, 4> op_0;
-	std::array<int, 4> op_1;
-	std::array<int, 4> op_2;
-	std::array<int, 4> op_3;
   const int pattern[32][6]={{ 0, 4, 8, 9,12,13},
                             { 1, 5, 9,10,13,14},
                             { 3, 2, 1, 5, 0, 4},
@@ -85,58 +108,474 @@ protected:
 
 class random_agent : public agent{
 public:
-	random_agent(const std::string& args = "") : agent(args){
+	random_agent(const std::string& args = "") : agent(args), seed(0){
 		if(meta.find("seed") != meta.end())
-			engine.seed(int(meta["seed"]));
+			seed = uint64_t(meta["seed"]);
+		engine.seed(seed);
 	}
 	virtual ~random_agent() {}
 
+	/**
+	 * an independent generator for worker thread 'index' of this agent
+	 * derived from seed=, so a threaded run is reproducible given the seed
+	 * and the thread count
+	 */
+	rng stream(size_t index) const {
+		return rng(seed, index + 1);
+	}
+
+	/**
+	 * restart the generator at the sequence of game 'index', so that runs
+	 * replaying the same index meet the same random choices
+	 */
+	void reseed(uint64_t index){
+		engine.seed(seed ^ 0x67616d65, index);
+	}
+
 protected:
-	std::default_random_engine engine;
+	uint64_t seed;
+	rng engine;
 };
 
 /**
  * base agent for agents with weight tables
  */
 class weight_agent : public random_agent{
+	friend class batch; // reads pattern to build the tuple indices of packed boards
 public:
-	weight_agent(const std::string& args = "") : random_agent(args){
+	/**
+	 * with 'lender', the agent reads the tables (and replicas) of that agent
+	 * instead of making its own, as the environments of the tournament
+	 * workers do; it neither loads, saves, replicates nor reloads them, and
+	 * 'lender' must outlive it
+	 */
+	weight_agent(const std::string& args = "", const weight_agent* lender = nullptr) : random_agent(args), page(weight::small), interval(0), episodes(0), writer(-1){
+		if(meta.find("page") != meta.end()) // pass page=thp|2m|1g to back the tables with huge pages
+			page = weight::page_of(meta["page"]);
+		if(meta.find("checkpoint") != meta.end()) // pass checkpoint=N to snapshot the weights every N episodes
+			interval = size_t(meta["checkpoint"]);
+		if(meta.find("tt") != meta.end()) // pass tt=MB to keep a transposition table across moves
+			memo.resize(size_t(meta["tt"]));
+		if(meta.find("stage") != meta.end()) // pass stage=384,768 to split the tables by the max tile
+			stage_bounds(meta["stage"]);
+		if(meta.find("tier") != meta.end()) // pass tier=path to back the later stages by files path.N
+			tier = meta["tier"].value;
+		if(meta.find("format") != meta.end()) // pass format=sparse to save only the non-zero entries
+			sparse = (meta["format"].value == "sparse");
+		if(meta.find("compress") != meta.end()) // pass compress=L to deflate a sparse file at zlib level L
+			level = int(meta["compress"]);
+		if(meta.find("shm") != meta.end()) // pass shm=name to share the tables with other processes
+			shared = meta["shm"].value;
+		if(meta.find("coordinator") != meta.end()) // pass coordinator=1 for the process that creates, loads and saves shm=
+			coordinator = int(meta["coordinator"]);
+		if(interval && (tier.size() || shared.size())){ // the fork would share these tables with the writers (MAP_SHARED)
+			std::cerr << "checkpoint= cannot snapshot tables backed by files (tier=) or shared memory (shm=), ignored" << std::endl;
+			interval = 0;
+		}
+		if(meta.find("reload") != meta.end()) // pass reload=path to swap in the weights of path when it changes (or on SIGHUP)
+			reload = meta["reload"].value;
+		if(meta.find("layout") != meta.end()) // pass layout=interleaved|split to set the order of the entries (see arrange)
+			layout = (meta["layout"].value == "interleaved") ? interleaved : split;
+		if(meta.find("eval") != meta.end()) // pass eval=tuple|quantized|heuristic to choose the leaf evaluator of the searches
+			evaluation = (meta["eval"].value == "quantized") ? by_quantized : (meta["eval"].value == "heuristic") ? by_heuristic : by_tuple;
+		for(auto& count : hits) count = 0;
+		if(lender) borrow(*lender);
 		//if (meta.find("init") != meta.end()) // pass init=... to initialize the weight
-			init_weights(meta["init"]);
-		if(meta.find("load") != meta.end()) // pass load=... to load from a specific file
+		else init_weights(meta["init"]);
+		if(meta.find("load") != meta.end() && owner()) // pass load=... to load from a specific file
 			load_weights(meta["load"]);
+		arrange();
+		if(evaluation == by_quantized) coarse = lender ? lender->coarse : std::make_shared<const quantized>(net);
+		if(evaluation == by_quantized && reload.size()) std::cerr << "eval=quantized keeps the tables loaded first, reload= does not apply to it" << std::endl;
+		if(store && coordinator) store->publish();
+		if(reload.size() && store){
+			std::cerr << "reload= does not apply to shared tables (shm=), ignored" << std::endl;
+			reload.clear();
+		}
+		if(meta.find("numa") != meta.end() && meta["numa"].value == "replicate" && reload.empty() && !lent) // read-only copies per node
+			replicate_weights();
+		if(reload.size()) start_reload();
 	}
 	virtual ~weight_agent(){
-		if(meta.find("save") != meta.end()) // pass save=... to save to a specific file
+		stop_reload();
+		wait_checkpoint();
+		if(meta.find("save") != meta.end() && owner()) // pass save=... to save to a specific file
 			save_weights(meta["save"]);
 	}
+	virtual void close_episode(const std::string& flag = ""){
+		++episodes;
+	}
+
+private:
+	void reap(int status){
+		if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			std::cerr << "checkpoint: a snapshot failed (status " << status << ")" << std::endl;
+		writer = -1;
+	}
+public:
+
+	/**
+	 * fork a copy-on-write snapshot every 'checkpoint' episodes
+	 * the child saves the weights to the save= path and runs 'extra' (e.g. saving
+	 * the statistic), while the parent returns immediately and keeps playing
+	 * a snapshot is skipped if the previous one is still being written
+	 */
+	template<typename job>
+	bool checkpoint(job extra){
+		if(interval == 0 || episodes % interval != 0 || meta.find("save") == meta.end() || !owner()) return false;
+		if(writer > 0){
+			int status = 0;
+			if(waitpid(writer, &status, WNOHANG) == 0) return false;
+			reap(status);
+		}
+		std::cout.flush();
+		pid_t pid = fork();
+		if(pid == 0){
+			bool saved = write_tables(meta["save"]);
+			if(saved) extra();
+			_exit(saved ? 0 : 1);
+		}
+		writer = pid;
+		return pid > 0;
+	}
+	/**
+	 * block until the pending snapshot (if any) is written, so that it can
+	 * never overwrite a later save
+	 */
+	void wait_checkpoint(){
+		int status = 0;
+		if(writer > 0 && waitpid(writer, &status, 0) == writer) reap(status);
+		writer = -1;
+	}
+	/**
+	 * continue the checkpoint cadence of a run resumed after 'done' episodes
+	 */
+	virtual void resume(size_t done){
+		episodes = done;
+	}
  
 public:
     int find_index(int j, board as){
         int last = as.last;
         if(last == -1){ last = 4; }
         int index = as.operator()(pattern[j][0])+as.operator()(pattern[j][1])*15+as.operator()(pattern[j][2])*225+as.operator()(pattern[j][3])*3375+as.operator()(pattern[j][4])*50625+as.operator()(pattern[j][5])*759375;        
-        index = 11390625 * (4 * last + (as.hint - 1)) + index;//11390625 * 4 * last + 11390625 * (h - 1) + index;
+        index = span * (4 * last + (as.hint - 1)) + index * stride;//11390625 * 4 * last + 11390625 * (h - 1) + index;
         return index;
     }
+
+    /**
+     * the tile part of the 32 tuple indices, i.e. find_index without the
+     * (last, hint) context offset, which is added at lookup time
+     * searches carry the keys along with the board and update them with
+     * update_keys, so a placement touches 12 tuples instead of rebuilding 32
+     */
+    typedef std::array<int, 32> keys;
+
+    keys tuple_keys(const board& as) const {
+        profiler::scope timer(profiler::index);
+        keys key;
+        for(int j = 0; j < 32; ++j){
+            key[j] = (as(pattern[j][0])+as(pattern[j][1])*15+as(pattern[j][2])*225+as(pattern[j][3])*3375+as(pattern[j][4])*50625+as(pattern[j][5])*759375) * stride;
+        }
+        return key;
+    }
+    void update_keys(keys& key, int pos, int from, int to) const {
+        if(from == to) return;
+        for(int k = 0; k < touches[pos]; ++k) key[touch[pos][k][0]] += (to - from) * touch[pos][k][1];
+    }
+    void update_keys(keys& key, const board& from, const board& to) const {
+        profiler::scope timer(profiler::index);
+        for(int pos = 0; pos < 16; ++pos) update_keys(key, pos, from(pos), to(pos));
+    }
+    int context(const board& as) const {
+        int last = (as.last == -1) ? 4 : as.last;
+        return span * (4 * last + (as.hint - 1));
+    }
+
+    /**
+     * leaf evaluation: the sum of the 32 tuple weights of an afterstate
+     * reads the replica of the calling thread's numa node if replicated
+     */
+    float estimate(const board& as) const {
+        return estimate(as, tuple_keys(as));
+    }
+    float estimate(const board& as, const keys& key) const {
+        profiler::scope timer(profiler::eval);
+        const std::vector<weight>& w = tables();
+        int offset = context(as);
+        int s = staged(as.max);
+        float score = 0;
+        for(int j = 0; j < 32; ++j){
+            if(j < 16) score += w[2 * s][key[j] + offset];
+            else score += w[2 * s + 1][key[j] + offset];
+        }
+        return score;
+    }
+
+    /**
+     * the stage of an afterstate with max tile 'max': the number of stage=
+     * boundaries reached; stage s owns the tables net[2s] (tuples 0-15) and
+     * net[2s+1] (tuples 16-31)
+     * stage counts the afterstate for report_stages and is called once per
+     * move played; the leaves of the searches call staged, so that no thread
+     * writes a shared counter per leaf
+     */
+    int stage(int max) const {
+        if(bounds.empty()) return 0;
+        int s = staged(max);
+        hits[s].fetch_add(1, std::memory_order_relaxed);
+        return s;
+    }
+    int staged(int max) const {
+        int s = 0;
+        while(s < int(bounds.size()) && max >= bounds[s]) ++s;
+        return s;
+    }
+
+    /**
+     * the leaf evaluators of the searches (eval=), passed to them as a
+     * template parameter, so the choice is made once per search, not per leaf:
+     *  tuple: the n-tuple network (estimate), the default
+     *  quantized: the 16-bit copy of the network (see quantized.h)
+     *  heuristic: the board alone (see heuristic), for an agent without
+     *  trained weights such as the usual rndenv, which then neither reads
+     *  the tables nor keeps the tuple keys
+     * an evaluator tells whether the searches need the tuple keys (keyed),
+     * prefetches the entries of a leaf, and widens the bounds of the network
+     * values to its own (for the pruning of expectimax)
+     */
+    enum { by_tuple, by_quantized, by_heuristic };
+    struct tuple_policy{
+        static constexpr bool keyed = true;
+        static float value(const weight_agent& a, const board& as, const keys& key){ return a.estimate(as, key); }
+        static void prefetch(const weight_agent& a, const board& as, const keys& key){ a.prefetch_leaf(as, key); }
+        static void bound(const weight_agent& a, float& low, float& high){}
+    };
+    struct quantized_policy{
+        static constexpr bool keyed = true;
+        static float value(const weight_agent& a, const board& as, const keys& key){
+            profiler::scope timer(profiler::eval);
+            const quantized& q = *a.coarse;
+            int offset = a.context(as), s = a.staged(as.max);
+            const int16_t* w0 = q.data(2 * s);
+            const int16_t* w1 = q.data(2 * s + 1);
+            int sum0 = 0, sum1 = 0;
+            for(int j = 0; j < 16; ++j) sum0 += w0[key[j] + offset];
+            for(int j = 16; j < 32; ++j) sum1 += w1[key[j] + offset];
+            return sum0 * q.scale(2 * s) + sum1 * q.scale(2 * s + 1);
+        }
+        static void prefetch(const weight_agent& a, const board& as, const keys& key){
+            int offset = a.context(as), s = a.staged(as.max);
+            for(int j = 0; j < 32; ++j) __builtin_prefetch(a.coarse->data(2 * s + j / 16) + key[j] + offset);
+        }
+        static void bound(const weight_agent& a, float& low, float& high){
+            low -= a.coarse->error();
+            high += a.coarse->error();
+        }
+    };
+    struct heuristic_policy{
+        static constexpr bool keyed = false;
+        static float value(const weight_agent& a, const board& as, const keys& key){ return heuristic(as); }
+        static void prefetch(const weight_agent& a, const board& as, const keys& key){}
+        static void bound(const weight_agent& a, float& low, float& high){
+            low = -2 * 8 * 15; // of the 3 steps of a line, the rises or the falls are a single step, at most 15
+            high = 8 * 16 + 4 * 24;
+        }
+    };
+
+    /**
+     * the hand-crafted value of an afterstate (eval=heuristic): 8 per empty
+     * cell, 4 per pair of neighbors that can merge (1 and 2, or equal tiles
+     * from 3 up), less 2 per step of tile index that keeps a row or column
+     * from being monotonic (the smaller of its rises and falls)
+     * the value is a sum over the 4 rows and 4 columns, looked up by the
+     * tiles of the line (4 bits each)
+     */
+    static float heuristic(const board& as){
+        profiler::scope timer(profiler::eval);
+        static const std::vector<float> line = lines();
+        float value = 0;
+        for(int l = 0; l < 4; ++l){
+            value += line[as(4 * l) | as(4 * l + 1) << 4 | as(4 * l + 2) << 8 | as(4 * l + 3) << 12];
+            value += line[as(l) | as(l + 4) << 4 | as(l + 8) << 8 | as(l + 12) << 12];
+        }
+        return value;
+    }
+    static std::vector<float> lines(){
+        std::vector<float> line(1 << 16);
+        for(int v = 0; v < (1 << 16); ++v){
+            int empty = 0, merges = 0, rise = 0, fall = 0;
+            for(int k = 0; k < 4; ++k) empty += ((v >> (4 * k)) & 15) == 0;
+            for(int k = 0; k < 3; ++k){
+                int a = (v >> (4 * k)) & 15, b = (v >> (4 * k + 4)) & 15;
+                if(a && b && (a + b == 3 || (a == b && a >= 3))) ++merges;
+                if(a < b) rise += b - a;
+                else fall += a - b;
+            }
+            line[v] = 4 * empty + 4 * merges - 2 * std::min(rise, fall); // a cell is in a row and a column
+        }
+        return line;
+    }
+
+    /**
+     * the value of an afterstate by the evaluator of eval=, for the callers
+     * outside of the templated searches (mcts=, the player without depth=)
+     */
+    float evaluate(const board& as) const {
+        return evaluate(as, evaluation == by_heuristic ? keys() : tuple_keys(as));
+    }
+    float evaluate(const board& as, const keys& key) const {
+        switch(evaluation){
+            case by_quantized: return quantized_policy::value(*this, as, key);
+            case by_heuristic: return heuristic_policy::value(*this, as, key);
+            default: return tuple_policy::value(*this, as, key);
+        }
+    }
+
+    /**
+     * the slides of a 'b' node whose children are leaves, evaluated like a
+     * stackless coroutine: issue() makes the first afterstate and prefetches
+     * its 32 weights, and the node is resolved later, once the caller has
+     * issued the next node
+     * while expectimax resolves a node, slide k + 1 is made and fetched
+     * before slide k is summed, so that two lookups are in flight inside the
+     * node too and a cutoff wastes at most one slide; minimax makes a slide
+     * only once the slides before it are summed, as its ordered alpha-beta
+     * cuts off after the first slide so often that fetching ahead was 20%
+     * slower there
+     */
+    struct leaves{
+        board before;
+        keys base;
+        unsigned rest; // the slides not made yet
+        int n = 0;
+        int reward[4];
+        board as[4];
+        keys key[4];
+    };
+    template<typename evaluator>
+    void issue(const board& before, const keys& key, leaves& node) const {
+        node.before = before;
+        if(evaluator::keyed) node.base = key;
+        node.rest = before.movable();
+        node.n = 0;
+        advance<evaluator>(node);
+    }
+    template<typename evaluator>
+    void advance(leaves& node) const {
+        if(node.rest == 0) return;
+        board& after = node.as[node.n];
+        after = node.before;
+        node.reward[node.n] = after.slide(__builtin_ctz(node.rest));
+        after.type = 'a';
+        if(evaluator::keyed){
+            node.key[node.n] = node.base;
+            update_keys(node.key[node.n], node.before, after);
+        }
+        evaluator::prefetch(*this, after, node.key[node.n]);
+        node.rest &= node.rest - 1;
+        ++node.n;
+    }
+    void prefetch_leaf(const board& as, const keys& key) const {
+        const std::vector<weight>& w = tables();
+        int offset = context(as), s = staged(as.max);
+        for(int j = 0; j < 32; ++j) __builtin_prefetch(w[2 * s + j / 16].data() + key[j] + offset);
+    }
+
+    /**
+     * the weight tables local to the calling thread
+     * with reload=, the tables held by the reading scope of the thread (or
+     * the latest tables, not held, outside of any scope)
+     */
+    const std::vector<weight>& tables() const {
+        if(reading::held().first == this) return *reading::held().second;
+        if(reload.size()) return *std::atomic_load(&current);
+        int node = topology::current();
+        if(node == 0 || replica.size() < size_t(node)) return net;
+        return replica[node - 1];
+    }
     
+    /**
+     * whether the ratio of bonus tiles so far still allows another one
+     * fixed for a whole search, hence passed down as 'bonus'
+     */
+    bool bonus_allowed() const {
+        return (num_bonus+1)/(total+1) <= 1/21;
+    }
+
+    /**
+     * a thread can point this at a flag to abandon its searches early
+     * (the result of an abandoned search is meaningless)
+     */
+    static const std::atomic<bool>*& halt(){
+        static thread_local const std::atomic<bool>* flag = nullptr;
+        return flag;
+    }
+
     float minimax(board before, int depth, float alpha, float beta){
-        int index;
+        return minimax<tuple_policy>(before, tuple_keys(before), depth, alpha, beta, bonus_allowed());
+    }
+    /**
+     * alpha-beta search, consulting the transposition table (tt=) at depth >= 2
+     * a stored result settles the node if it is deep enough, otherwise its
+     * best move is searched first
+     */
+    template<typename evaluator>
+    float minimax(board before, const keys& key, int depth, float alpha, float beta, bool bonus){
+        if(halt() && halt()->load(std::memory_order_relaxed)) return 0;
+        int best = -1;
+        if(!memo.enabled() || depth < 2) return expand<evaluator>(before, key, depth, alpha, beta, bonus, best);
+        uint64_t hash = memo.hash(before, bonus);
+        transposition::entry e;
+        if(memo.probe(hash, e)){
+            best = e.move;
+            if(e.depth >= depth){
+                if(e.type == transposition::exact) return e.value;
+                if(e.type == transposition::lower) alpha = std::max(alpha, e.value);
+                if(e.type == transposition::upper) beta = std::min(beta, e.value);
+                if(beta <= alpha) return e.value;
+            }
+        }
+        float value = expand<evaluator>(before, key, depth, alpha, beta, bonus, best);
+        if(halt() && halt()->load(std::memory_order_relaxed)) return value;
+        transposition::bound type = (value <= alpha) ? transposition::upper : (value >= beta) ? transposition::lower : transposition::exact;
+        memo.store(hash, value, depth, type, best);
+        return value;
+    }
+
+    /**
+     * one node of minimax; 'best' is the move to try first on entry (-1 for
+     * none), and the best move found on return
+     */
+    template<typename evaluator>
+    float expand(board before, const keys& key, int depth, float alpha, float beta, bool bonus, int& best){
         int layer = depth - 1;
         board after;
+        keys next;
+        int order[17], n = 0;
+        if(best >= 0 && best < 16) order[n++] = best;
         if(before.type == 'b'){
             int r, v = 0;
             float score = -999999;
-            for(int i = 0; i < 4; ++i){
+            for(unsigned m = before.movable(); m; m &= m - 1){
+                if(int(__builtin_ctz(m)) != best) order[n++] = __builtin_ctz(m);
+            }
+            if(n && !(before.movable() >> order[0] & 1)) order[0] = order[--n];
+            for(int k = 0; k < n; ++k){
+                int i = order[k];
                 after = before;
                 r = after.slide(i);
-                if(r != -1){
-                    v = 1;
-                    after.type = 'a';
-                    score = std::max(score, r + minimax(after, layer, alpha, beta));
-                    alpha = std::max(alpha, score);
-                    if(beta <= alpha) break;//]
+                v = 1;
+                after.type = 'a';
+                if(evaluator::keyed){
+                    next = key;
+                    update_keys(next, before, after);
                 }
+                float child = r + minimax<evaluator>(after, next, layer, alpha, beta, bonus);
+                if(child > score) best = i;
+                score = std::max(score, child);
+                alpha = std::max(alpha, score);
+                if(beta <= alpha) break;//]
             }
             if(v == 1) return score;
             return -1;
@@ -145,12 +584,7 @@ public:
             float score = 0;
             //depth = 0
             if(depth == 0){
-                for(int j = 0; j < 32; ++j){
-                    index = find_index(j,before);
-                    if(j < 16) score += net[0][index];
-                    else score += net[1][index];
-                }
-                return score;
+                return evaluator::value(*this, before, key);
             }
             if(before.bag[0] == 0 && before.bag[1] == 0 && before.bag[2] == 0){
                 before.bag[0] = 4;
@@ -159,164 +593,134 @@ public:
             }
             //depth != 0
             score = 9999999;
-            int last = before.last;
-            if(last == 0){
-                for(int pos : op_0){
-                    if(before(pos) != 0) continue;
-                    after = before;
-                    after.type = 'b';
-                    after.place(pos,before.hint);
-                    //max >= 7
-                    if(before.max > 6 && (num_bonus+1)/(total+1) <= 1/21){
-                        after.bag = before.bag;
-                        //generate new hint
-                        for(int i = 4; i <= (before.max-3); ++i){
-                            after.hint = i;
-                            float t = minimax(after, layer, alpha, beta);
-                            if(t == -1) return -1;
-                            else{
-                                score = std::min(score, t);
-                                beta = std::min(beta, score);
-                                if(beta <= alpha) break;//\                                
-                            }
-                        }
-                    }        
-                    for(int i = 0; i < 3; ++i){
-                        if(before.bag[i] > 0){//bag contains i
-                            after.bag = before.bag;
-                            //generate new hint
-                            after.hint = i+1;
-                            --after.bag[i];
-                            float t = minimax(after, layer, alpha, beta);
-                            if(t == -1) return -1;
-                            else{
-                                score = std::min(score, t);
-                                beta = std::min(beta, score);
-                                if(beta <= alpha) break;//\                                
-                            }
-                        }
-                    }                                
-                }
+            for(unsigned m = before.placeable(); m; m &= m - 1){
+                if(int(__builtin_ctz(m)) != best) order[n++] = __builtin_ctz(m);
             }
-            else if(last == 1){
-                for(int pos : op_1){
-                    if(before(pos) != 0) continue;
-                    after = before;
-                    after.type = 'b';
-                    after.place(pos,before.hint);
-                    //max >= 7
-                    if(before.max > 6 && (num_bonus+1)/(total+1) <= 1/21){
-                        after.bag = before.bag;
-                        //generate new hint
-                        for(int i = 4; i <= (before.max-3); ++i){
-                            after.hint = i;
-                            float t = minimax(after, layer, alpha, beta);
-                            if(t == -1) return -1;
-                            else{
-                                score = std::min(score, t);
-                                beta = std::min(beta, score);
-                                if(beta <= alpha) break;//\                                
-                            }
-                        }
-                    }          
-                    for(int i = 0; i < 3; ++i){
-                        if(before.bag[i] > 0){//bag contains i
-                            after.bag = before.bag;
-                            //generate new hint
-                            after.hint = i+1;
-                            --after.bag[i];
-                            float t = minimax(after, layer, alpha, beta);
-                            if(t == -1) return -1;
-                            else{
-                                score = std::min(score, t);
-                                beta = std::min(beta, score);
-                                if(beta <= alpha) break;//\                                
-                            }
-                        }
-                    }                       
+            if(n && !(before.placeable() >> order[0] & 1)) order[0] = order[--n];
+#if INTERLEAVE
+            if(depth == 2) return interleave<evaluator>(before, key, alpha, beta, bonus, order, n, best);
+#endif
+            for(int k = 0; k < n; ++k){
+                int pos = order[k];
+                after = before;
+                after.type = 'b';
+                after.place(pos,before.hint);
+                if(evaluator::keyed){
+                    next = key;
+                    update_keys(next, pos, before(pos), after(pos));
                 }
-            }
-            else if(last == 2){
-                for(int pos : op_2){
-                    if(before(pos) != 0) continue;
-                    after = before;
-                    after.type = 'b';
-                    after.place(pos,before.hint);
-                    //max >= 7
-                    if(before.max > 6 && (num_bonus+1)/(total+1) <= 1/21){
-                        after.bag = before.bag;
-                        //generate new hint
-                        for(int i = 4; i <= (before.max-3); ++i){
-                            after.hint = i;
-                            float t = minimax(after, layer, alpha, beta);
-                            if(t == -1) return -1;
-                            else{
-                                score = std::min(score, t);
-                                beta = std::min(beta, score);
-                                if(beta <= alpha) break;//\                                
-                            }
+                //max >= 7
+                if(before.max > 6 && bonus){
+                    after.bag = before.bag;
+                    //generate new hint
+                    for(int i = 4; i <= (before.max-3); ++i){
+                        after.hint = i;
+                        float t = minimax<evaluator>(after, next, layer, alpha, beta, bonus);
+                        if(t == -1){ best = pos; return -1; }
+                        else{
+                            if(t < score) best = pos;
+                            score = std::min(score, t);
+                            beta = std::min(beta, score);
+                            if(beta <= alpha) break;//\                                
                         }
                     }
-                    for(int i = 0; i < 3; ++i){
-                        if(before.bag[i] > 0){//bag contains i
-                            after.bag = before.bag;
-                            //generate new hint
-                            after.hint = i+1;
-                            --after.bag[i];
-                            float t = minimax(after, layer, alpha, beta);
-                            if(t == -1) return -1;
-                            else{
-                                score = std::min(score, t);
-                                beta = std::min(beta, score);
-                                if(beta <= alpha) break;//\                                
-                            }
-                        }
-                    }                    
                 }
-            }
-            else if(last == 3){
-                for(int pos : op_3){
-                    if(before(pos) != 0) continue;
-                    after = before;
-                    after.type = 'b';
-                    after.place(pos,before.hint);
-                    //max >= 7
-                    if(before.max > 6 && (num_bonus+1)/(total+1) <= 1/21){
+                for(int i = 0; i < 3; ++i){
+                    if(before.bag[i] > 0){//bag contains i
                         after.bag = before.bag;
                         //generate new hint
-                        for(int i = 4; i <= (before.max-3); ++i){
-                            after.hint = i;
-                            float t = minimax(after, layer, alpha, beta);
-                            if(t == -1) return -1;
-                            else{
-                                score = std::min(score, t);
-                                beta = std::min(beta, score);
-                                if(beta <= alpha) break;//\                                
-                            }
+                        after.hint = i+1;
+                        --after.bag[i];
+                        float t = minimax<evaluator>(after, next, layer, alpha, beta, bonus);
+                        if(t == -1){ best = pos; return -1; }
+                        else{
+                            if(t < score) best = pos;
+                            score = std::min(score, t);
+                            beta = std::min(beta, score);
+                            if(beta <= alpha) break;//\                                
                         }
                     }
-                    for(int i = 0; i < 3; ++i){
-                        if(before.bag[i] > 0){//bag contains i
-                            after.bag = before.bag;
-                            //generate new hint
-                            after.hint = i+1;
-                            --after.bag[i];
-                            float t = minimax(after, layer, alpha, beta);
-                            if(t == -1) return -1;
-                            else{
-                                score = std::min(score, t);
-                                beta = std::min(beta, score);
-                                if(beta <= alpha) break;//\                                
-                            }
-                        }
-                    }                    
-                }
+                }                    
             }
             return score;
         }
         std::cout<<"wrong"<<std::endl;
         return 0;
     }    
+
+    /**
+     * the 'a' branch of expand with two plies left, as a pipeline over its
+     * children (the 'b' nodes whose slides are leaves): the children are
+     * listed in the order of expand, and the next one is issued before the
+     * current one is resolved; a cutoff skips the rest of its group (the
+     * bonus hints or the bag tiles of a position) as the loops of expand do
+     */
+    template<typename evaluator>
+    float interleave(const board& before, const keys& key, float alpha, float beta, bool bonus, const int* order, int n, int& best){
+        struct reply{ int pos, hint, tile, group; };
+        reply child[16 * 15]; // every cell, with up to 12 bonus hints and 3 basic tiles
+        int count = 0, groups = 0;
+        for(int k = 0; k < n; ++k){
+            int pos = order[k];
+            if(before.max > 6 && bonus){
+                for(int i = 4; i <= (before.max-3); ++i) child[count++] = { pos, i, -1, groups };
+                ++groups;
+            }
+            for(int i = 0; i < 3; ++i){
+                if(before.bag[i] > 0) child[count++] = { pos, i+1, i, groups };
+            }
+            ++groups;
+        }
+        leaves node[2];
+        keys next;
+        auto start = [&](int k, leaves& into){
+            board after = before;
+            after.type = 'b';
+            after.place(child[k].pos, before.hint);
+            after.hint = child[k].hint;
+            if(child[k].tile >= 0) --after.bag[child[k].tile];
+            if(evaluator::keyed){
+                next = key;
+                update_keys(next, child[k].pos, before(child[k].pos), after(child[k].pos));
+            }
+            issue<evaluator>(after, next, into);
+        };
+        float score = 9999999;
+        if(count) start(0, node[0]);
+        auto following = [&](int k, bool cut){ // the child resolved after child k
+            int next = k + 1;
+            while(cut && next < count && child[next].group == child[k].group) ++next;
+            return next;
+        };
+        for(int k = 0, cur = 0; k < count; cur ^= 1){
+            int ahead = following(k, beta <= alpha); // once cut, every child cuts its group
+            if(ahead < count) start(ahead, node[cur ^ 1]);
+            if(halt() && halt()->load(std::memory_order_relaxed)) return 0;
+            float t = resolve<evaluator>(node[cur], alpha, beta);
+            if(t == -1){ best = child[k].pos; return -1; }
+            if(t < score) best = child[k].pos;
+            score = std::min(score, t);
+            beta = std::min(beta, score);
+            int next = following(k, beta <= alpha);
+            if(next != ahead && next < count) start(next, node[cur ^ 1]);
+            k = next;
+        }
+        return score;
+    }
+    /**
+     * the value of an issued 'b' node in minimax, as expand would find it
+     */
+    template<typename evaluator>
+    float resolve(leaves& node, float alpha, float beta){
+        if(node.n == 0) return -1;
+        float score = -999999;
+        for(int k = 0; k < node.n || (node.rest && (advance<evaluator>(node), true)); ++k){ // one slide at a time, see leaves
+            score = std::max(score, node.reward[k] + evaluator::value(*this, node.as[k], node.key[k]));
+            alpha = std::max(alpha, score);
+            if(beta <= alpha) break;
+        }
+        return score;
+    }
     /*
     float minimax(board before, int depth){
         int index;
@@ -347,12 +751,7 @@ public:
             float score = 0;            
             //depth = 0
             if(depth == 0){
-                for(int j = 0; j < 32; ++j){
-                    index = find_index(j,before);
-                    if(j < 16) score += net[0][index];
-                    else score += net[1][index];
-                }
-                return score;
+                return estimate(before);
             }
             if(before.bag[0] == 0 && before.bag[1] == 0 && before.bag[2] == 0){
                 before.bag[0] = 4;
@@ -490,33 +889,329 @@ public:
 
 protected:
 	virtual void init_weights(const std::string& info){
-		net.emplace_back(227812500); // create an empty weight table with size 15**6*4*5
-		net.emplace_back(227812500); // now net.size() == 2; net[0].size() == 227812500; net[1].size() == 227812500
+		if(shared.size()){ // every table of every stage in the segment
+			if(layout < 0) layout = split; // fixed before any process loads
+			store.reset(new segment(shared, std::vector<size_t>(2 * (bounds.size() + 1), 227812500), layout, coordinator));
+			for(size_t t = 0; t < 2 * (bounds.size() + 1); ++t) net.emplace_back(store->table(t), 227812500);
+			return;
+		}
+		net.emplace_back(227812500, page); // create an empty weight table with size 15**6*4*5
+		net.emplace_back(227812500, page); // now net.size() == 2; net[0].size() == 227812500; net[1].size() == 227812500
+		for(size_t t = 2; t < 2 * (bounds.size() + 1); ++t){ // the later stages, never on huge pages
+			if(tier.empty()) net.emplace_back(227812500, weight::small); // only the touched pages take memory
+			else net.emplace_back(227812500, tier + "." + std::to_string(t));
+		}
+	}
+	/**
+	 * views of the tables and replicas of 'lender', held as they are at
+	 * this point (with reload= on the lender, later reloads are not seen)
+	 */
+	void borrow(const weight_agent& lender){
+		lent = lender.latest();
+		layout = lender.layout;
+		for(const weight& w : *lent) net.emplace_back(const_cast<float*>(w.data()), w.size());
+		for(const std::vector<weight>& copy : lender.replica){
+			replica.emplace_back();
+			for(const weight& w : copy) replica.back().emplace_back(const_cast<float*>(w.data()), w.size());
+		}
+		shared.clear();
+		reload.clear();
 	}
 	virtual void load_weights(const std::string& path){
+		if(!read_tables(path, net)) std::exit(-1);
+	}
+	/**
+	 * read the tables of 'path' into 'into', which has the tables of init_weights
+	 * a file of one stage (2 tables) loaded with stage= seeds every stage,
+	 * otherwise the file must have the tables of every stage
+	 * the format (raw or sparse) and the order of the entries are told by the
+	 * header; the first file loaded sets the order unless layout= is given,
+	 * and a file of the other order is converted as it is loaded
+	 */
+	bool read_tables(const std::string& path, std::vector<weight>& into){
+		profiler::scope timer(profiler::io);
+		archive file(path);
 		std::ifstream in(path, std::ios::in | std::ios::binary);
-		if(!in.is_open()) std::exit(-1);
+		if(!in.is_open()) return false;
 		uint32_t size;
 		in.read(reinterpret_cast<char*>(&size), sizeof(size));
-		net.resize(size);
-		for(weight& w : net) in >> w;
-		in.close();
+		int order = size >> 24;
+		size &= 0xffffff;
+		if(file.open()) size = file.tables(), order = file.layout();
+		if(order != split && order != interleaved){
+			std::cerr << path << ": unknown layout " << order << std::endl;
+			return false;
+		}
+		if((bounds.size() || store) && size != 2 && size != into.size()){
+			std::cerr << path << " has " << size << " tables, stage= needs 2 or " << into.size() << std::endl;
+			return false;
+		}
+		if(bounds.empty() && !store) into.resize(size, weight(page));
+		if(file.open()){
+			if(!file.load(into)) return false;
+		}else{
+			for(size_t t = 0; t < size; ++t) in >> into[t];
+			if(!in) return false;
+		}
+		if(layout < 0) layout = order;
+		for(size_t t = 0; t < size && order != layout; ++t){
+			if(order == split) into[t].permute([](size_t i){ return i % 11390625 * 20 + i / 11390625; });
+			else into[t].permute([](size_t i){ return i % 20 * 11390625 + i / 20; });
+		}
+		for(size_t t = size; t < into.size(); ++t) into[t].copy_sparse(into[t % 2]);
+		return true;
+	}
+	/**
+	 * copy the tables onto every other numa node (node 0 keeps net)
+	 * and pin the calling thread to node 0
+	 * replicas are never written back, so this is for evaluation only
+	 */
+	virtual void replicate_weights(){
+		replica.clear();
+		for(int node = 1; node < topology::nodes(); ++node){
+			replica.emplace_back();
+			for(const weight& w : net){ // only the touched pages, so a lazy or file-backed stage stays sparse
+				replica.back().emplace_back(w.size(), page, node);
+				replica.back().back().copy_sparse(w);
+			}
+		}
+		topology::bind(0);
 	}
 	virtual void save_weights(const std::string& path){
-		std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
-		if(!out.is_open()) std::exit(-1);
-		uint32_t size = net.size();
+		if(!write_tables(path)) std::exit(-1);
+	}
+	/**
+	 * write the tables to 'path', return whether it succeeded (a forked
+	 * snapshot must not run the exit handlers of the parent)
+	 */
+	bool write_tables(const std::string& path){
+		profiler::scope timer(profiler::io);
+		std::string temp = path + ".tmp"; // write aside then rename, so a crash never leaves a torn file
+		std::shared_ptr<const std::vector<weight>> tables = latest();
+		if(sparse) return archive::save(temp, *tables, level, layout) && std::rename(temp.c_str(), path.c_str()) == 0;
+		std::ofstream out(temp, std::ios::out | std::ios::binary | std::ios::trunc);
+		if(!out.is_open()) return false;
+		uint32_t size = tables->size() | uint32_t(layout) << 24; // the top byte is the order of the entries
 		out.write(reinterpret_cast<char*>(&size), sizeof(size));
-		for(weight& w : net) out << w;
+		for(const weight& w : *tables) out << w;
 		out.close();
+		return out && std::rename(temp.c_str(), path.c_str()) == 0;
+	}
+
+	/**
+	 * whether this process loads and saves the tables: always, unless they
+	 * are shared (shm=) and it is not the coordinator
+	 */
+	bool owner() const {
+		return (!store || coordinator) && !lent;
+	}
+
+	/**
+	 * the order of the entries of every table (layout=), for a tuple
+	 * configuration 'key' (the tile part of find_index) and a context
+	 * c = 4 * last + hint - 1 (0 to 19):
+	 *  split: entry 11390625 * c + key, the original order, where the
+	 *  contexts of a configuration are 45 MB apart
+	 *  interleaved: entry 20 * key + c, the 20 contexts of a configuration in
+	 *  80 adjacent bytes, so the siblings of a search that differ only in
+	 *  the hint or the last slide read the same one or two cache lines
+	 * the keys of the searches are kept in units of 'stride', and context()
+	 * in units of 'span'; the weight files record the order in the top byte
+	 * of their table count (0 for split, as in the files before layout=)
+	 */
+	void arrange(){
+		if(layout < 0) layout = split;
+		stride = (layout == interleaved) ? 20 : 1;
+		span = (layout == interleaved) ? 1 : 11390625;
+		std::fill(std::begin(touches), std::end(touches), 0);
+		for(int j = 0; j < 32; ++j){ // the tuples (and the power of 15) each cell contributes to
+			for(int k = 0, power = stride; k < 6; ++k, power *= 15){
+				int pos = pattern[j][k];
+				touch[pos][touches[pos]][0] = j;
+				touch[pos][touches[pos]][1] = power;
+				++touches[pos];
+			}
+		}
+	}
+
+	/**
+	 * parse stage= as the tile values (e.g. 384) where the later stages start
+	 */
+	void stage_bounds(const std::string& list){
+		std::stringstream in(list);
+		for(std::string value; std::getline(in, value, ','); ){
+			int v = std::stoi(value), t = 0;
+			while(t < 15 && ((t > 3) ? (1 << (t - 3)) * 3 : t) < v) ++t;
+			if(bounds.empty() || t > bounds.back()) bounds.push_back(t);
+		}
+	}
+
+public:
+	/**
+	 * with stage=, show the afterstates played in every stage since the last report, and
+	 * the size and resident part of its tables:
+	 *	stage 0 (< 384) = 1523348 (92.1%), 1738 MB, 312 MB resident
+	 *	stage 1 (>= 384) = 131051 (7.9%), 1738 MB, 24 MB resident
+	 */
+	void report_stages(std::ostream& out){
+		if(bounds.empty()) return;
+		uint64_t count[16], sum = 0;
+		for(size_t s = 0; s <= bounds.size(); ++s) sum += (count[s] = hits[s].exchange(0));
+		std::shared_ptr<const std::vector<weight>> tables = latest();
+		std::ios ff(nullptr);
+		ff.copyfmt(out);
+		out << std::fixed << std::setprecision(1);
+		for(size_t s = 0; s <= bounds.size(); ++s){
+			auto value = [](int t){ return (t > 3) ? (1 << (t - 3)) * 3 : t; };
+			const weight& low = (*tables)[2 * s];
+			const weight& high = (*tables)[2 * s + 1];
+			size_t bytes = low.size() * sizeof(float) + high.size() * sizeof(float);
+			size_t resident = low.resident() + high.resident();
+			out << "\tstage " << s << " (";
+			if(s > 0) out << ">= " << value(bounds[s - 1]) << (s < bounds.size() ? ", " : "");
+			if(s < bounds.size()) out << "< " << value(bounds[s]);
+			out << ") = " << count[s] << " (" << (sum ? count[s] * 100.0 / sum : 0) << "%), ";
+			out << (bytes >> 20) << " MB, " << (resident >> 20) << " MB resident" << std::endl;
+		}
+		out << std::endl;
+		out.copyfmt(ff);
 	}
 
 public:
+	/**
+	 * the bytes of the weight store (tables and replicas), or only the
+	 * part of it resident in memory
+	 */
+	size_t footprint(bool resident = false) const {
+		size_t bytes = 0;
+		for(const weight& w : *latest()) bytes += resident ? w.resident() : w.size() * sizeof(float);
+		for(const std::vector<weight>& copy : replica)
+			for(const weight& w : copy) bytes += resident ? w.resident() : w.size() * sizeof(float);
+		return bytes;
+	}
+
+    /**
+     * the published tables: net, or with reload= the latest tables loaded
+     */
+    std::shared_ptr<const std::vector<weight>> latest() const {
+        if(reload.size()) return std::atomic_load(&current);
+        return std::shared_ptr<const std::vector<weight>>(std::shared_ptr<const std::vector<weight>>(), &net);
+    }
+
+    /**
+     * with reload=, holds the latest tables for the calling thread while it
+     * searches, so that a reload never frees tables under a search; scopes
+     * nest, and the innermost one of an agent is read by tables()
+     */
+    class reading{
+    public:
+        reading(const weight_agent& agent) : prior(held()){
+            if(agent.reload.empty()) return;
+            hold = agent.latest();
+            held() = { &agent, hold.get() };
+        }
+        ~reading(){ held() = prior; }
+        static std::pair<const weight_agent*, const std::vector<weight>*>& held(){
+            static thread_local std::pair<const weight_agent*, const std::vector<weight>*> scope(nullptr, nullptr);
+            return scope;
+        }
+    private:
+        std::pair<const weight_agent*, const std::vector<weight>*> prior;
+        std::shared_ptr<const std::vector<weight>> hold;
+    };
+
     int num_bonus = 0;
     int total = 0;
 
 protected:
+	/**
+	 * hot reload (reload=path): the tables move from net into 'current', and
+	 * a watcher thread polls every 100 ms for a new modification time of the
+	 * path (to the nanosecond, so two saves within a second are both seen) or
+	 * a SIGHUP; it then reads the file into fresh tables while play
+	 * goes on, and publishes them by swapping 'current', so searches started
+	 * before keep the tables they hold, which are freed with the last holder
+	 * the fresh tables take memory of their own until the old ones are freed
+	 */
+	void start_reload(){
+		current = std::make_shared<std::vector<weight>>(std::move(net));
+		net.clear();
+		hangups();
+		std::signal(SIGHUP, [](int){ ++hangups(); });
+		watching = true;
+		watcher = std::thread([this](){
+			struct stat info;
+			struct timespec seen = {0, 0};
+			if(stat(reload.c_str(), &info) == 0) seen = info.st_mtim;
+			unsigned signaled = hangups();
+			for(; watching; std::this_thread::sleep_for(std::chrono::milliseconds(100))){
+				bool changed = stat(reload.c_str(), &info) == 0
+					&& (info.st_mtim.tv_sec != seen.tv_sec || info.st_mtim.tv_nsec != seen.tv_nsec);
+				if(!changed && hangups() == signaled) continue;
+				if(changed) seen = info.st_mtim;
+				signaled = hangups();
+				std::shared_ptr<const std::vector<weight>> old = std::atomic_load(&current);
+				std::shared_ptr<std::vector<weight>> fresh = std::make_shared<std::vector<weight>>();
+				for(size_t t = 0; t < old->size(); ++t) fresh->emplace_back((*old)[t].size(), t < 2 ? page : weight::small);
+				old.reset();
+				if(!read_tables(reload, *fresh)){
+					std::cerr << "reload: cannot read " << reload << ", keeping the tables" << std::endl;
+					continue;
+				}
+				reloaded(*fresh);
+				std::atomic_store(&current, std::shared_ptr<const std::vector<weight>>(fresh));
+				std::cerr << "reload: " << reload << std::endl;
+			}
+		});
+	}
+	/**
+	 * stop watching, and return the latest tables to net
+	 */
+	void stop_reload(){
+		if(!watching) return;
+		watching = false;
+		watcher.join();
+		net = std::move(const_cast<std::vector<weight>&>(*current)); // no reader is left
+		current.reset();
+		reload.clear();
+	}
+	/**
+	 * called with fresh tables before they are published
+	 */
+	virtual void reloaded(const std::vector<weight>& fresh) {}
+	static std::atomic<unsigned>& hangups(){
+		static std::atomic<unsigned> count(0);
+		return count;
+	}
+
 	std::vector<weight> net;
+	std::vector<std::vector<weight>> replica;
+	weight::page page;
+	std::vector<int> bounds; // the max tile index where each later stage starts (stage=)
+	std::string tier; // the prefix of the files backing the later stages (tier=)
+	bool sparse = false; // save in the format of archive (format=sparse)
+	int level = 0; // the zlib level of a sparse file (compress=)
+	std::string shared; // the name of the shared memory segment (shm=)
+	bool coordinator = false;
+	std::unique_ptr<segment> store;
+	std::string reload; // the path watched by reload=
+	std::shared_ptr<const std::vector<weight>> current; // the published tables with reload=
+	std::shared_ptr<const std::vector<weight>> lent; // the tables of the lender, held while borrowed
+	std::atomic<bool> watching{false};
+	std::thread watcher;
+	mutable std::array<std::atomic<uint64_t>, 16> hits;
+	transposition memo;
+	enum { split = 0, interleaved = 1 };
+	int layout = -1; // the order of the entries (layout=, or that of the first file loaded)
+	int evaluation = by_tuple; // the leaf evaluator of the searches (eval=)
+	std::shared_ptr<const quantized> coarse; // the 16-bit tables of eval=quantized
+	int stride = 1;
+	int span = 11390625;
+	int touch[16][32][2];
+	int touches[16];
+	size_t interval;
+	size_t episodes;
+	pid_t writer;
 };
 
 /**
@@ -527,6 +1222,19 @@ public:
 	learning_agent(const std::string& args = "") : weight_agent(args), alpha(0.1f/32){
 		if(meta.find("alpha") != meta.end())
 			alpha = float(meta["alpha"]);
+		if(alpha != 0 && replica.size()){
+			std::cerr << "numa=replicate is read-only, ignored while training (alpha != 0)" << std::endl;
+			replica.clear();
+		}
+		if(alpha != 0 && reload.size()){
+			std::cerr << "reload= is read-only, ignored while training (alpha != 0)" << std::endl;
+			stop_reload();
+		}
+		if(alpha != 0 && evaluation == by_quantized){ // the copy is made once, so the searches would never see the updates
+			std::cerr << "eval=quantized is read-only, ignored while training (alpha != 0)" << std::endl;
+			evaluation = by_tuple;
+			coarse.reset();
+		}
 	}
 	virtual ~learning_agent() {}
 
@@ -539,14 +1247,56 @@ protected:
  */
 class rndenv : public weight_agent {
 public:
-	rndenv(const std::string& args = "") : weight_agent("name=random role=environment " + args),  bag({4, 4, 4}),
+	rndenv(const std::string& args = "", rndenv* lender = nullptr) : weight_agent("name=random role=environment " + args, lender),  bag({4, 4, 4}),
         space({ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }), initial({1,1,1,1,2,2,2,2,3,3,3,3}) { 
             std::shuffle(space.begin(), space.end(), engine);
             std::shuffle(initial.begin(), initial.end(), engine);
+            keeper = lender;
+            if(meta.find("ponder") != meta.end()) // pass ponder=1 to search replies while the player decides
+                pondering = int(meta["ponder"]);
+            if(meta.find("depth") != meta.end()) // pass depth=N to search N plies below a reply (odd, 7 by default)
+                horizon = std::max(1, int(meta["depth"]) | 1);
+            if(meta.find("mcts") != meta.end()){ // pass mcts=N to reply by tree search within N nodes (0 for the default)
+                tree = true;
+                if(int(meta["mcts"]) > 0) limit.nodes = int(meta["mcts"]);
+                limit.seed = seed;
+            }
+            if(meta.find("time") != meta.end()) // pass time=T to stop the tree search after T milliseconds
+                limit.ms = int(meta["time"]);
+            if(meta.find("workers") != meta.end()) // pass workers=W to share the tree search among W threads
+                limit.workers = std::max(1, int(meta["workers"]));
+            if(meta.find("rollout") != meta.end()) // pass rollout=P to value the tree leaves after P random plies
+                limit.rollout = int(meta["rollout"]);
+            if(meta.find("uct") != meta.end()) // pass uct=C to set the exploration constant
+                limit.explore = float(meta["uct"]);
+            if(meta.find("openings") != meta.end()) // pass openings=N to record the first N replies of every game into book=
+                openings = int(meta["openings"]);
+            if(meta.find("book") != meta.end()){ // pass book=path to look up the early replies in an opening book
+                shelf = meta["book"].value;
+                size_t entries = (meta.find("booksize") != meta.end()) ? size_t(meta["booksize"]) : (1 << 20); // pass booksize=E to bound a new book
+                if(!keeper) library = book(openings ? entries : 0);
+                if(!keeper && !library.load(shelf) && !openings) std::cerr << "book: cannot read " << shelf << std::endl;
+            }
+    }
+    virtual ~rndenv(){
+        abandon();
+        if(shelf.empty()) return;
+        if(keeper){ // the lender saves the book once, and reports the probes of every environment
+            std::lock_guard<std::mutex> lock(keeper->shelving);
+            keeper->probes += probes;
+            keeper->found += found;
+            return;
+        }
+        if(openings > 0 && !library.save(shelf)) std::cerr << "book: cannot write " << shelf << std::endl;
+        std::cout << "book: " << found << " of " << probes << " early replies found";
+        std::cout << ", " << library.size() << " entries of " << library.plies() << " plies" << std::endl;
     }
 
 	void reset(){
+        abandon();
+        if(memo.enabled()) memo.clear();
         initial = {1,1,1,1,2,2,2,2,3,3,3,3};
+        space = {{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }}; // from the fixed order, so a game depends only on the generator (reseed)
         std::shuffle(initial.begin(), initial.end(), engine);
         std::shuffle(space.begin(), space.end(), engine);
         bag[0] = 4;
@@ -556,14 +1306,11 @@ public:
         num_bonus = 0;
         now = 0;
         previous = 0;
+        decisions = 0;
     }
     
     virtual action take_action(const board& before){
         //std::cout<<bag[0]<<" "<<bag[1]<<" "<<bag[2]<<std::endl;
-        float score = 999999999;
-        int depth = 7;
-        int at = 100;
-        board after;
         previous = now;        
         ++total;
         if(previous > 3){
@@ -590,210 +1337,208 @@ public:
                     return action::place(pos, previous);
                 }
             case 0:
-                 for(int pos : op_0){
-                    if(before(pos) != 0) continue;
-                    after = before;
-                    after.type = 'b';
-                    after.place(pos,previous);
-                    for(int i = 0; i < 3; ++i){
-                        if(bag[i] > 0){//bag contains i
-                            after.bag = bag;
-                            //generate new hint
-                            after.hint = i+1;
-                            --after.bag[i];
-                            float t = minimax(after, depth, -999999, 999999999);
-                            //float t = minimax(after, depth);
-                            if(t == -1){
-                                now = i+1;
-                                --bag[now-1];
-                                return action::place(pos, previous);
-                            }
-                            else if(score > t){
-                                score = t;
-                                now = i+1;
-                                at = pos;
-                            }
-                        }
-                    }
-                    //max >= 7
-                    if(before.max > 6 && (num_bonus+1)/(total+1) <= 1/21){
-                        after.bag = bag;
-                        //generate new hint
-                        for(int i = 4; i <= (before.max-3); ++i){
-                            after.hint = i;
-                            float t = minimax(after, depth, -999999, 999999999);
-                            //float t = minimax(after, depth);
-                            if(t == -1){
-                                now = i;
-                                return action::place(pos, previous);
-                            }
-                            else if(score > t){
-                                score = t;
-                                now = i;
-                                at = pos;
-                            }
-                        }
-                    }
-                }
-                if(now < 4) --bag[now-1];
-                return action::place(at, previous);
             case 1:
-                 for(int pos : op_1){
-                    if(before(pos) != 0) continue;
-                    after = before;
-                    after.type = 'b';
-                    after.place(pos,previous);
-                    for(int i = 0; i < 3; ++i){
-                        if(bag[i] > 0){//bag contains i
-                            after.bag = bag;
-                            //generate new hint
-                            after.hint = i+1;
-                            --after.bag[i];
-                            float t = minimax(after, depth, -999999, 999999999);
-                            //float t = minimax(after, depth);
-                            if(t == -1){
-                                now = i+1;
-                                --bag[now-1];
-                                return action::place(pos, previous);
-                            }
-                            else if(score > t){
-                                score = t;
-                                now = i+1;
-                                at = pos;
-                            }
-                        }
-                    }
-                    //max >= 7
-                    if(before.max > 6 && (num_bonus+1)/(total+1) <= 1/21){
-                        after.bag = bag;
-                        //generate new hint
-                        for(int i = 4; i <= (before.max-3); ++i){
-                            after.hint = i;
-                            float t = minimax(after, depth, -999999, 999999999);
-                            //float t = minimax(after, depth);
-                            if(t == -1){
-                                now = i;
-                                return action::place(pos, previous);
-                            }
-                            else if(score > t){
-                                score = t;
-                                now = i;
-                                at = pos;
-                            }
-                        }
-                    }
-                }
-                if(now < 4) --bag[now-1];
-                return action::place(at, previous);
             case 2:
-                 for(int pos : op_2){
-                    if(before(pos) != 0) continue;
-                    after = before;
-                    after.type = 'b';
-                    after.place(pos,previous);
-                    for(int i = 0; i < 3; ++i){
-                        if(bag[i] > 0){//bag contains i
-                            after.bag = bag;
-                            //generate new hint
-                            after.hint = i+1;
-                            --after.bag[i];
-                            float t = minimax(after, depth, -999999, 999999999);
-                            //float t = minimax(after, depth);
-                            if(t == -1){
-                                now = i+1;
-                                --bag[now-1];
-                                return action::place(pos, previous);
-                            }
-                            else if(score > t){
-                                score = t;
-                                now = i+1;
-                                at = pos;
-                            }
-                        }
-                    }
-                    //max >= 7
-                    if(before.max > 6 && (num_bonus+1)/(total+1) <= 1/21){
-                        after.bag = bag;
-                        //generate new hint
-                        for(int i = 4; i <= (before.max-3); ++i){
-                            after.hint = i;
-                            float t = minimax(after, depth, -999999, 999999999);
-                            //float t = minimax(after, depth);
-                            if(t == -1){
-                                now = i;
-                                return action::place(pos, previous);
-                            }
-                            else if(score > t){
-                                score = t;
-                                now = i;
-                                at = pos;
-                            }
-                        }
-                    }
-                }
-                if(now < 4) --bag[now-1];
-                return action::place(at, previous);
             case 3:
-                 for(int pos : op_3){
-                    if(before(pos) != 0) continue;
-                    after = before;
-                    after.type = 'b';
-                    after.place(pos,previous);
-                    for(int i = 0; i < 3; ++i){
-                        if(bag[i] > 0){//bag contains i
-                            after.bag = bag;
-                            //generate new hint
-                            after.hint = i+1;
-                            --after.bag[i];
-                            float t = minimax(after, depth, -999999, 999999999);
-                            //float t = minimax(after, depth);
-                            if(t == -1){
-                                now = i+1;
-                                --bag[now-1];
-                                return action::place(pos, previous);
-                            }
-                            else if(score > t){
-                                score = t;
-                                now = i+1;
-                                at = pos;
-                            }
-                        }
-                    }
-                    //max >= 7
-                    if(before.max > 6 && (num_bonus+1)/(total+1) <= 1/21){
-                        after.bag = bag;
-                        //generate new hint
-                        for(int i = 4; i <= (before.max-3); ++i){
-                            after.hint = i;
-                            float t = minimax(after, depth, -999999, 999999999);
-                            //float t = minimax(after, depth);
-                            if(t == -1){
-                                now = i;
-                                return action::place(pos, previous);
-                            }
-                            else if(score > t){
-                                score = t;
-                                now = i;
-                                at = pos;
-                            }
-                        }
-                    }
+            {
+                reply plan = pondered(before);
+                memo.age();
+                bool bonus = bonus_allowed();
+                int ply = decisions++;
+                if(plan.at == -1 && shelved([&](book& on){
+                        if(ply >= on.plies()) return false;
+                        ++probes;
+                        return on.probe(before, bag, previous, bonus, plan.at, plan.now);
+                    })) ++found;
+                if(plan.at == -1){
+                    plan = respond(before, bag, previous, bonus);
+                    if(ply < openings) shelved([&](book& on){ on.store(ply, before, bag, previous, bonus, plan.at, plan.now); });
                 }
+                now = plan.now;
                 if(now < 4) --bag[now-1];
-                return action::place(at, previous);
+                return action::place(plan.at, previous);
+            }
             default:
                 return action();
         }        
 	}
 
+    /**
+     * run 'act' on the book of this environment: its own, or the book of
+     * its lender under the lender's lock, so that the tournament workers
+     * record into one book which is saved once
+     */
+    template<typename access>
+    auto shelved(access act) -> decltype(act(std::declval<book&>())) {
+        if(!keeper) return act(library);
+        std::lock_guard<std::mutex> lock(keeper->shelving);
+        return act(keeper->library);
+    }
+
+    /**
+     * the decision of the environment after a slide: where to place the
+     * 'previous' hint, and which hint to announce next ('now')
+     * it depends only on its arguments, so it can be computed ahead of time
+     */
+    struct reply{
+        int at;
+        int now;
+    };
+    reply respond(const board& before, const std::array<int, 3>& bag, int previous, bool bonus){
+        profiler::scope timer(profiler::reply);
+        reading pin(*this);
+        if(tree){
+            mcts::choice c = mcts(limit).search(before, bag, previous, bonus,
+                [this](const board& as){ return evaluate(as); }, halt());
+            return { c.at, c.hint };
+        }
+        switch(evaluation){
+            case by_quantized: return respond<quantized_policy>(before, bag, previous, bonus);
+            case by_heuristic: return respond<heuristic_policy>(before, bag, previous, bonus);
+            default: return respond<tuple_policy>(before, bag, previous, bonus);
+        }
+    }
+    template<typename evaluator>
+    reply respond(const board& before, const std::array<int, 3>& bag, int previous, bool bonus){
+        float score = 999999999;
+        int depth = horizon;
+        reply plan = { 100, previous };
+        board after;
+        keys key, next;
+        if(evaluator::keyed) key = tuple_keys(before);
+        for(unsigned m = before.placeable(); m; m &= m - 1){
+            int pos = __builtin_ctz(m);
+            after = before;
+            after.type = 'b';
+            after.place(pos,previous);
+            if(evaluator::keyed){
+                next = key;
+                update_keys(next, pos, before(pos), after(pos));
+            }
+            for(int i = 0; i < 3; ++i){
+                if(bag[i] > 0){//bag contains i
+                    after.bag = bag;
+                    //generate new hint
+                    after.hint = i+1;
+                    --after.bag[i];
+                    float t = minimax<evaluator>(after, next, depth, -999999, 999999999, bonus);
+                    //float t = minimax(after, depth);
+                    if(t == -1){
+                        return { pos, i+1 };
+                    }
+                    else if(score > t){
+                        score = t;
+                        plan = { pos, i+1 };
+                    }
+                }
+            }
+            //max >= 7
+            if(before.max > 6 && bonus){
+                after.bag = bag;
+                //generate new hint
+                for(int i = 4; i <= (before.max-3); ++i){
+                    after.hint = i;
+                    float t = minimax<evaluator>(after, next, depth, -999999, 999999999, bonus);
+                    //float t = minimax(after, depth);
+                    if(t == -1){
+                        return { pos, i };
+                    }
+                    else if(score > t){
+                        score = t;
+                        plan = { pos, i };
+                    }
+                }
+            }
+        }
+        return plan;
+    }
+
+    /**
+     * pondering (ponder=1): while the player decides on 'state', search the
+     * reply to each of its legal slides on background threads
+     * take_action then commits the one matching the actual slide, and
+     * abandons the others
+     */
+    void ponder(const board& state){
+        if(!pondering) return;
+        abandon();
+        memo.age();
+        int ahead = now; // the state take_action will see after this slide
+        int bonuses = num_bonus + (ahead > 3 ? 1 : 0);
+        bool bonus = (bonuses+1)/(total+2) <= 1/21;
+        std::array<int, 3> refill = bag;
+        if(refill[0] == 0 && refill[1] == 0 && refill[2] == 0) refill = {{ 4, 4, 4 }};
+        for(unsigned m = state.movable(); m; m &= m - 1){
+            int i = __builtin_ctz(m);
+            guess& g = guesses[i];
+            g.after = state;
+            g.after.slide(i);
+            g.stop = false;
+            g.active = true;
+            g.worker = std::thread([this, &g, refill, ahead, bonus](){
+                halt() = &g.stop;
+                g.plan = respond(g.after, refill, ahead, bonus);
+                halt() = nullptr;
+            });
+        }
+    }
+
+    /**
+     * stop and discard every pondered reply
+     */
+    void abandon(){
+        for(guess& g : guesses){
+            if(!g.active) continue;
+            g.stop = true;
+            g.worker.join();
+            g.active = false;
+        }
+    }
+
 public:
     int now = 0;
     std::array<int, 3> bag;
     
 private:
+    /**
+     * the pondered reply matching the actual slide, or { -1, -1 } if none
+     */
+    reply pondered(const board& before){
+        reply plan = { -1, -1 };
+        for(guess& g : guesses){
+            if(!g.active || g.after != before || g.after.last != before.last) continue;
+            g.worker.join();
+            g.active = false;
+            plan = g.plan;
+        }
+        abandon();
+        return plan;
+    }
+
+    struct guess{
+        board after;
+        reply plan;
+        std::thread worker;
+        std::atomic<bool> stop;
+        bool active = false;
+    };
+
     std::array<int, 16> space;
     std::vector<int> initial;
     int previous = 0;
+    bool pondering = false;
+    int horizon = 7; // the plies of minimax below a reply (depth=)
+    std::array<guess, 4> guesses;
+    bool tree = false;
+    mcts::budget limit;
+    book library;
+    rndenv* keeper = nullptr; // the lender whose book this environment shares (a tournament worker)
+    std::mutex shelving; // guards the book while the environments of other threads share it
+    std::string shelf; // the path of the book (book=)
+    int openings = 0;
+    int decisions = 0; // the searched decisions of this game so far
+    size_t probes = 0;
+    size_t found = 0;
 };
 
 /**
@@ -802,245 +1547,286 @@ private:
  */
 class player : public learning_agent{
 public:
-	player(const std::string& args = "") : learning_agent("name=learning role=player " + args) {}
+	player(const std::string& args = "") : learning_agent("name=learning role=player " + args), depth(0), ms(0){
+		if(meta.find("depth") != meta.end()) // pass depth=N to search N more slides beyond the current one
+			depth = int(meta["depth"]);
+		if(meta.find("ms") != meta.end()) // pass ms=T to deepen iteratively within T milliseconds per move
+			ms = int(meta["ms"]);
+		if(meta.find("online") != meta.end()) // pass online=1 to update after every move instead of after the episode
+			online = int(meta["online"]);
+		if(meta.find("lambda") != meta.end()) // pass lambda=L to learn from TD(L) returns instead of TD(0)
+			lambda = float(meta["lambda"]);
+		if(meta.find("tc") != meta.end() && int(meta["tc"]) && alpha != 0){ // pass tc=1 for temporal coherence learning rates
+			for(const weight& w : net) coherence.emplace_back(2 * w.size(), page);
+		}
+		if(depth > 0 || ms > 0) bound_weights();
+	}
+	virtual void resume(size_t done){
+		weight_agent::resume(done);
+		if(done && coherence.size()) // E and A are not saved with the weights
+			std::cerr << "tc=1 restarts the coherence rates of the resumed run from a step of 1" << std::endl;
+	}
 
-    //search
-    float expectimax(board before, int k){
-        int index;
-        int layer = k-1;
+    /**
+     * search budget of one decision: an optional deadline (ms=) checked every
+     * 256 nodes; an expired search is abandoned by its caller
+     */
+    struct budget{
+        std::chrono::steady_clock::time_point deadline;
+        bool timed = false;
+        bool expired = false;
+        size_t nodes = 0;
+        bool exhausted(){
+            if(timed && (++nodes & 255) == 0 && std::chrono::steady_clock::now() > deadline) expired = true;
+            return expired;
+        }
+    };
+
+    /**
+     * expectimax with Star1 pruning
+     *
+     * 'b' nodes are the player to move and return the best reward plus child
+     * value (0 if no slide is legal); 'a' nodes are afterstates, valued by the
+     * network when depth == 0, otherwise by the expectation over the
+     * environment's replies:
+     *  - the position is uniform over the empty cells of the entry edge
+     *  - the placed tile is the hint, or uniform over 4..max-3 for a bonus hint
+     *  - the next hint is a bonus tile with probability 1/21 (if allowed), or
+     *    a basic tile in proportion to its count in the bag
+     * the chance nodes cut off as soon as the bounds [lower, upper(depth)] on
+     * the remaining children decide the result against (alpha, beta), in which
+     * case the returned value is only a bound
+     */
+    template<typename evaluator>
+    float expectimax(const board& before, const keys& key, int depth, float alpha, float beta, budget& limit){
+        if(limit.exhausted()) return 0;
         board after;
-        //play node
+        keys next;
         if(before.type == 'b'){
-            float score = -99999;
-            int r, v = 0;
-            for(int i = 0; i < 4; ++i){                
+            float score = 0;
+            bool found = false;
+            for(unsigned m = before.movable(); m; m &= m - 1){
+                int i = __builtin_ctz(m);
                 after = before;
-                r = after.slide(i);
-                if(r != -1){
-                    v = 1;
-                    after.type = 'a';
-                    float child = expectimax(after, layer);
-                    child += r;
-                    if(score < child) score = child;
+                int r = after.slide(i);
+                after.type = 'a';
+                if(evaluator::keyed){
+                    next = key;
+                    update_keys(next, before, after);
                 }
+                float child = r + expectimax<evaluator>(after, next, depth, (found ? std::max(alpha, score) : alpha) - r, beta - r, limit);
+                if(!found || child > score) score = child;
+                found = true;
+                if(score >= beta) break;
             }
-            //existing child-node
-            if(v == 1) return score;
-            //non-existing child-node
-            return -1;
+            return score;
         }
-        //evil node
-        else if(before.type == 'a'){
-            float score = 0;            
-            //depth = 0
-            if(k == 0){
-                for(int j = 0; j < 32; ++j){
-                    index = find_index(j,before);
-                    if(j < 16) score += net[0][index];
-                    else score += net[1][index];
-                }
-                return score;
-            }
-            //depth != 0
-            float value[3];
-            float num_child = 0;
-            int child[3];
-            int last = before.last;            
-            int v = 0;
-            if(before.bag[0] == 0 && before.bag[1] == 0 && before.bag[2] == 0){
-                before.bag[0] = 4;
-                before.bag[1] = 4;
-                before.bag[2] = 4;
-            }
-            child[0] = before.bag[0];
-            child[1] = before.bag[1];
-            child[2] = before.bag[2];
-            if(last == 0){
-                for(int pos : op_0){
-                    if(before(pos) != 0) continue;
-                    value[0] = 0;
-                    value[1] = 0;
-                    value[2] = 0;
-                    after = before;
-                    after.type = 'b';
-                    if(before.hint != 4) after.place(pos,before.hint);
-                    else after.place(pos, 4 + (std::rand()%((before.max-3) - 4 + 1)));                 
-                    for(int i = 0; i < 3; ++i){
-                        if(before.bag[i] > 0){//bag contains i
-                            after.bag = before.bag;
-                            //generate new hint
-                            after.hint = i+1;
-                            --after.bag[i];
-                            float t = expectimax(after, layer);
-                            if(t != -1){
-                                value[i] = t;
-                                v = 1;
-                                num_child += child[i];
-                            }
-                        }
-                    }
-                    score += value[0] * child[0] + value[1] * child[1] + value[2] * child[2];
-                    //max >= 7(48)
-                    if(before.max == 7){
-                        after.bag = before.bag;
-                        //generate new hint
-                        after.hint = 4;
-                        float t = expectimax(after, layer);
-                        if(t != -1){
-                            score += t*0.05;
-                            v = 1;
-                            num_child += 0.05;
-                        }
-                    }
-                }
-            }
-            else if(last == 1){
-                for(int pos : op_1){
-                    if(before(pos) != 0) continue;
-                    value[0] = 0;
-                    value[1] = 0;
-                    value[2] = 0;
-                    after = before;
-                    after.type = 'b';
-                    if(before.hint != 4) after.place(pos,before.hint);
-                    else after.place(pos, 4 + (std::rand()%((before.max-3) - 4 + 1)));                 
-                    for(int i = 0; i < 3; ++i){
-                        if(before.bag[i] > 0){//bag contains i
-                            after.bag = before.bag;
-                            //generate new hint
-                            after.hint = i+1;
-                            --after.bag[i];
-                            float t = expectimax(after, layer);
-                            if(t != -1){
-                                value[i] = t;
-                                v = 1;
-                                num_child += child[i];
-                            }
-                        }
-                    }
-                    score += value[0] * child[0] + value[1] * child[1] + value[2] * child[2];
-                    //max >= 7(48)
-                    if(before.max == 7){
-                        after.bag = before.bag;
-                        //generate new hint
-                        after.hint = 4;
-                        float t = expectimax(after, layer);
-                        if(t != -1){
-                            score += t*0.05;
-                            v = 1;
-                            num_child += 0.05;
-                        }
-                    }
+        if(depth == 0) return evaluator::value(*this, before, key);
+        std::array<int, 3> bag = before.bag;
+        if(bag[0] == 0 && bag[1] == 0 && bag[2] == 0) bag = {{ 4, 4, 4 }};
+        unsigned cells = before.placeable();
+        if(cells == 0) return evaluator::value(*this, before, key);
+        int lo = before.hint, hi = before.hint;
+        if(before.hint == 4){ lo = 4; hi = std::max(4, before.max - 3); }
+        float bonus = (before.max > 6 && (num_bonus + 1) * 21 <= (total + 1)) ? 1.0f / 21 : 0;
+        float basic = (1 - bonus) / (bag[0] + bag[1] + bag[2]);
+        float each = 1.0f / (__builtin_popcount(cells) * (hi - lo + 1));
+        float low = lower.load(std::memory_order_relaxed), top = ceiling.load(std::memory_order_relaxed);
+        evaluator::bound(*this, low, top);
+        float high = upper(before, depth, top);
+#if INTERLEAVE
+        if(depth == 1) return interleave<evaluator>(before, key, alpha, beta, limit, bag, lo, hi, bonus, basic, each);
+#endif
+        float sum = 0, rest = 1;
+        for(unsigned m = cells; m; m &= m - 1){
+            int pos = __builtin_ctz(m);
+            for(int tile = lo; tile <= hi; ++tile){
+                after = before;
+                after.type = 'b';
+                after.place(pos, tile);
+                if(evaluator::keyed){
+                    next = key;
+                    update_keys(next, pos, before(pos), after(pos));
                 }
-            }
-            else if(last == 2){
-                for(int pos : op_2){
-                    if(before(pos) != 0) continue;
-                    value[0] = 0;
-                    value[1] = 0;
-                    value[2] = 0;
-                    after = before;
-                    after.type = 'b';
-                    if(before.hint != 4) after.place(pos,before.hint);
-                    else after.place(pos, 4 + (std::rand()%((before.max-3) - 4 + 1)));                 
-                    for(int i = 0; i < 3; ++i){
-                        if(before.bag[i] > 0){//bag contains i
-                            after.bag = before.bag;
-                            //generate new hint
-                            after.hint = i+1;
-                            --after.bag[i];
-                            float t = expectimax(after, layer);
-                            if(t != -1){
-                                value[i] = t;
-                                v = 1;
-                                num_child += child[i];
-                            }
-                        }
-                    }
-                    score += value[0] * child[0] + value[1] * child[1] + value[2] * child[2];
-                    //max >= 7(48)
-                    if(before.max == 7){
-                        after.bag = before.bag;
-                        //generate new hint
-                        after.hint = 4;
-                        float t = expectimax(after, layer);
-                        if(t != -1){
-                            score += t*0.05;
-                            v = 1;
-                            num_child += 0.05;
-                        }
-                    }
+                for(int h = 0; h < 4; ++h){
+                    float p = each * (h < 3 ? basic * bag[h] : bonus);
+                    if(p == 0) continue;
+                    after.hint = h + 1;
+                    after.bag = bag;
+                    if(h < 3) --after.bag[h];
+                    float a = (alpha - sum - (rest - p) * high) / p;
+                    float b = (beta - sum - (rest - p) * low) / p;
+                    float v = expectimax<evaluator>(after, next, depth - 1, std::max(a, low), std::min(b, high), limit);
+                    sum += p * v;
+                    rest -= p;
+                    if(sum + rest * high <= alpha) return sum + rest * high;
+                    if(sum + rest * low >= beta) return sum + rest * low;
                 }
             }
-            else if(last == 3){
-                for(int pos : op_3){
-                    if(before(pos) != 0) continue;
-                    value[0] = 0;
-                    value[1] = 0;
-                    value[2] = 0;
-                    after = before;
-                    after.type = 'b';
-                    if(before.hint != 4) after.place(pos,before.hint);
-                    else after.place(pos, 4 + (std::rand()%((before.max-3) - 4 + 1)));                 
-                    for(int i = 0; i < 3; ++i){
-                        if(before.bag[i] > 0){//bag contains i
-                            after.bag = before.bag;
-                            //generate new hint
-                            after.hint = i+1;
-                            --after.bag[i];
-                            float t = expectimax(after, layer);
-                            if(t != -1){
-                                value[i] = t;
-                                v = 1;
-                                num_child += child[i];
-                            }
-                        }
-                    }
-                    score += value[0] * child[0] + value[1] * child[1] + value[2] * child[2];
-                    //max >= 7(48)
-                    if(before.max == 7){
-                        after.bag = before.bag;
-                        //generate new hint
-                        after.hint = 4;
-                        float t = expectimax(after, layer);
-                        if(t != -1){
-                            score += t*0.05;
-                            v = 1;
-                            num_child += 0.05;
-                        }
-                    }
+        }
+        return sum;
+    }
+
+    /**
+     * the chance branch of expectimax with one ply left, as a pipeline over
+     * its replies: the 'b' node of the next reply is issued (see leaves)
+     * before the current one is resolved, with the same Star1 cutoffs
+     */
+    template<typename evaluator>
+    float interleave(const board& before, const keys& key, float alpha, float beta, budget& limit,
+            const std::array<int, 3>& bag, int lo, int hi, float bonus, float basic, float each){
+        struct reply{ int pos, tile, hint; float p; };
+        reply child[16 * 12 * 4];
+        int count = 0;
+        for(unsigned m = before.placeable(); m; m &= m - 1){
+            for(int tile = lo; tile <= hi; ++tile){
+                for(int h = 0; h < 4; ++h){
+                    float p = each * (h < 3 ? basic * bag[h] : bonus);
+                    if(p != 0) child[count++] = { int(__builtin_ctz(m)), tile, h + 1, p };
                 }
             }
-            if(v == 1){
-                score /= num_child;
-                return score;
+        }
+        leaves node[2];
+        keys next;
+        auto start = [&](int k, leaves& into){
+            board after = before;
+            after.type = 'b';
+            after.place(child[k].pos, child[k].tile);
+            after.hint = child[k].hint;
+            after.bag = bag;
+            if(child[k].hint < 4) --after.bag[child[k].hint - 1];
+            if(evaluator::keyed){
+                next = key;
+                update_keys(next, child[k].pos, before(child[k].pos), after(child[k].pos));
             }
-            score = 0;
-            for(int j = 0; j < 32; ++j){
-                //std::cout<<before<<before.empty<<std::endl;
-                index = find_index(j,before);                
-                if(j < 16) score += net[0][index];
-                else score += net[1][index];
+            issue<evaluator>(after, next, into);
+        };
+        float low = lower.load(std::memory_order_relaxed), top = ceiling.load(std::memory_order_relaxed);
+        evaluator::bound(*this, low, top);
+        float high = upper(before, 1, top);
+        float sum = 0, rest = 1;
+        if(count) start(0, node[0]);
+        for(int k = 0; k < count; ++k){
+            if(k + 1 < count) start(k + 1, node[(k + 1) % 2]);
+            float p = child[k].p;
+            float a = (alpha - sum - (rest - p) * high) / p;
+            float b = (beta - sum - (rest - p) * low) / p;
+            float v = resolve<evaluator>(node[k % 2], std::max(a, low), std::min(b, high), limit);
+            sum += p * v;
+            rest -= p;
+            if(sum + rest * high <= alpha) return sum + rest * high;
+            if(sum + rest * low >= beta) return sum + rest * low;
+        }
+        return sum;
+    }
+    /**
+     * the value of an issued 'b' node in expectimax, as its recursion would
+     * find it (a leaf is 0 once the budget is exhausted)
+     */
+    template<typename evaluator>
+    float resolve(leaves& node, float alpha, float beta, budget& limit){
+        if(limit.exhausted()) return 0;
+        float score = 0;
+        for(int k = 0; k < node.n; ++k){
+            if(k + 1 == node.n) advance<evaluator>(node); // slide k + 1 is fetched while slide k is summed
+            float child = node.reward[k] + (limit.exhausted() ? 0 : evaluator::value(*this, node.as[k], node.key[k]));
+            if(k == 0 || child > score) score = child;
+            if(score >= beta) break;
+        }
+        return score;
+    }
+
+    /**
+     * upper bound of the value of a 'b' node with 'depth' slides left: each
+     * slide merges at most once per row, into a tile at most one index larger
+     */
+    float upper(const board& as, int depth, float top) const {
+        float reward = std::max(5, as.merge_reward(std::min(as.max + depth, 15)));
+        return depth * 4 * reward + std::max(top, 0.0f);
+    }
+
+    /**
+     * rescan the tables for the bounds of the network value
+     */
+    void bound_weights(){
+        low_weight = {{ 0, 0 }};
+        high_weight = {{ 0, 0 }};
+        widen_bounds(*latest());
+    }
+    void widen_bounds(const std::vector<weight>& tables){
+        float lo[2] = { low_weight[0], low_weight[1] }, hi[2] = { high_weight[0], high_weight[1] };
+        for(int t = 0; t < int(tables.size()); ++t){ // the bounds of every stage, by tuple half
+            const float* w = tables[t].data();
+            for(size_t i = 0; i < tables[t].size(); ++i){
+                lo[t % 2] = std::min(lo[t % 2], w[i]);
+                hi[t % 2] = std::max(hi[t % 2], w[i]);
             }
-            return score;            
         }
-        //std::cout<<"gg\n";
-        return -1;
+        low_weight = { lo[0], lo[1] };
+        high_weight = { hi[0], hi[1] };
+        refresh_bounds();
     }
-     
+    /**
+     * reloaded tables (reload=) widen the search bounds, which then hold for
+     * searches on the old tables as well as on the new ones; the watcher
+     * widens them before it publishes the tables, so a search holding the
+     * new tables reads bounds that cover them
+     */
+    virtual void reloaded(const std::vector<weight>& fresh){
+        if(depth > 0 || ms > 0) widen_bounds(fresh);
+    }
+    void refresh_bounds(){
+        lower.store(std::min(0.0f, 16 * low_weight[0] + 16 * low_weight[1]), std::memory_order_relaxed);
+        ceiling.store(16 * high_weight[0] + 16 * high_weight[1], std::memory_order_relaxed);
+    }
+
     //action
 	virtual action take_action(const board &before){
-        int op, index, imdt_r;
-        int valid = 0;
-        float score = -999999;
-        float current[4] = {0};
-        std::array<int, 32> key;        
+        int index, imdt_r;
+        float score;
+        std::array<int, 32> key;
         board temp = before;
-        temp.type = 'a';
         temp.hint = hint;
-        temp.bag[0] = bag[0];
-        temp.bag[1] = bag[1];
-        temp.bag[2] = bag[2];
+        temp.bag = bag;
+        int op = decide(temp, score);
+        //action found
+        if(op != -1){
+            imdt_r = temp.slide(op);
+            for(int j = 0; j < 32; ++j){
+                index = find_index(j,temp);
+                key[j] = index;
+            }
+            int s = stage(temp.max);
+            if(online && alpha != 0 && state_key.size()){
+                float next = 0;
+                for(int j = 0; j < 32; ++j) next += net[2 * s + j / 16][key[j]];
+                update(state_key.back(), state_stage.back(), imdt_r + next);
+                ++updates;
+                state_key.back() = key;
+                state_stage.back() = s;
+                return action::slide(op);
+            }
+            state_key.push_back(key);
+            state_stage.push_back(s);
+            r.push_back(imdt_r);
+            return action::slide(op);
+        }
+        //action not found
+        return action();
+    }
+
+    /**
+     * find the best slide of a state (with its hint and bag) without
+     * recording anything for training, so it is safe to call concurrently
+     * return the opcode, or -1 if no slide is legal; 'score' is its value
+     */
+    int decide(const board &before, float &score){
+        reading pin(*this);
+        int op = -1;
+        float current[4] = {-1, -1, -1, -1};
+        board temp = before;
+        temp.type = 'a';
+        score = -999999;
         // find best action op
         /*#pragma omp parallel
         {
@@ -1062,80 +1848,183 @@ public:
                 }
             }
         }*/
-        for(int i = 0; i < 4; ++i){
+        keys key = (evaluation == by_heuristic) ? keys() : tuple_keys(temp);
+        if(depth > 0 || ms > 0){
+            switch(evaluation){
+                case by_quantized: return search<quantized_policy>(temp, key, score);
+                case by_heuristic: return search<heuristic_policy>(temp, key, score);
+                default: return search<tuple_policy>(temp, key, score);
+            }
+        }
+        for(unsigned m = temp.movable(); m; m &= m - 1){
+            int i = __builtin_ctz(m);
             board as = temp;
             int reward = as.slide(i);
-            current[i] += reward;
-            if(reward != -1){
-                current[i] += minimax(as, 0, -999999, 999999999);//searching i layers
-                //current[i] += minimax(as, 0);
-                //if(hint == 4 && as.max > 9) current[i] += expectimax(as, 0);
-                //else current[i] += expectimax(as, 0);//searching i layers
-            }
-        } 
+            keys next = key;
+            update_keys(next, temp, as);
+            current[i] = reward + evaluate(as, next);//searching i layers
+            //current[i] += minimax(as, 0);
+            //if(hint == 4 && as.max > 9) current[i] += expectimax(as, 0);
+            //else current[i] += expectimax(as, 0);//searching i layers
+        }
         for(int i = 0; i < 4; ++i){
             if(current[i] != -1 && score < current[i]){
                 score = current[i];
                 op = i;
-                valid = 1;
             }
         }
-        //action found
-        if(valid == 1){
-            imdt_r = temp.slide(op);
-            for(int j = 0; j < 32; ++j){
-                index = find_index(j,temp);
-                key[j] = index;
+        return op;
+    }
+    
+    /**
+     * the root of expectimax: a fixed depth=, or iterative deepening (up to
+     * depth= if given) until ms= expires, keeping the last finished iteration
+     */
+    template<typename evaluator>
+    int search(const board &temp, const keys &key, float &score){
+        budget limit;
+        if(ms > 0){
+            limit.timed = true;
+            limit.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+        }
+        int op = -1;
+        int from = (ms > 0) ? 0 : depth, to = (depth > 0) ? depth : 64;
+        for(int d = from; d <= to; ++d){
+            int best = -1;
+            float value = 0;
+            int order[4], n = 0;
+            if(op != -1) order[n++] = op; // the last best slide first, to raise alpha early
+            for(unsigned m = temp.movable(); m; m &= m - 1){
+                if(int(__builtin_ctz(m)) != op) order[n++] = __builtin_ctz(m);
             }
-            state_key.push_back(key);
-            r.push_back(imdt_r);
-            return action::slide(op);
+            for(int k = 0; k < n; ++k){
+                int i = order[k];
+                board as = temp;
+                int reward = as.slide(i);
+                as.type = 'a';
+                keys next = key;
+                if(evaluator::keyed) update_keys(next, temp, as);
+                float child = reward + expectimax<evaluator>(as, next, d, (best == -1) ? -HUGE_VALF : value - reward, HUGE_VALF, limit);
+                if(best == -1 || child > value){
+                    value = child;
+                    best = i;
+                }
+            }
+            if(limit.expired && op != -1) break;
+            op = best;
+            score = value;
+            if(limit.expired || op == -1) break;
         }
-        //action not found
-        return action();
+        return op;
     }
-    
+
     //training
     void training(){
-        float sum = 0;
-        float v_as, amend;
-        std::vector<std::array<int, 32>>::reverse_iterator iter = state_key.rbegin();
+        profiler::scope timer(profiler::train);
+        if(online){
+            if(alpha != 0 && state_key.size()){
+                update(state_key.back(), state_stage.back(), 0);
+                ++updates;
+            }
+            state_key.clear();
+            state_stage.clear();
+            r.clear();
+            return;
+        }
+        if(alpha == 0){
+            state_key.clear();
+            state_stage.clear();
+            r.clear();
+            return;
+        }
+        updates += state_key.size();
         r.push_back(0);
-        std::vector<int>::reverse_iterator rr = r.rbegin();
-        while(iter != state_key.rend()){
-            v_as = sum;
-            sum = 0;
+        float next = 0; // the value of the following afterstate, after its update
+        float ret = 0; // the lambda-return of the following afterstate
+        for(size_t t = state_key.size(); t-- > 0; ){
+            if(t > 0) prefetch(state_key[t - 1], state_stage[t - 1]);
+            ret = r[t + 1] + (1 - lambda) * next + lambda * ret;
+            next = update(state_key[t], state_stage[t], ret);
+        }
+        r.clear();
+        state_key.clear();
+        state_stage.clear();
+    }
+
+    /**
+     * one TD step: move the value of the afterstate with tuple indices 'key'
+     * in stage 's' toward 'target', and return its value after the update
+     * the value after the update is the old one plus each step times the
+     * number of times its index occurs in its half of 'key', as an entry
+     * repeated m times takes m steps and is summed m times (about one
+     * afterstate in six has a repeated index); the tables are not read again
+     *
+     * with tc=1, the step of each entry is scaled by its temporal coherence
+     * |E| / A, where E and A accumulate the errors and absolute errors seen by
+     * the entry (a step of 1 until an error is seen); E and A of entry i are
+     * 2i and 2i + 1 of a table twice the size of its table in net, so an
+     * entry costs one more cache line, and only touched pages take memory
+     */
+    float update(const std::array<int, 32>& key, int s, float target){
+        float* w[2] = { net[2 * s].data(), net[2 * s + 1].data() };
+        float sum = 0;
+        for(int j = 0; j < 32; ++j) sum += w[j / 16][key[j]];
+        float delta = target - sum;
+        float amend = alpha * delta;
+        float gain = 0; // the sum of the steps (in units of amend), each times its occurrences
+        auto occurrences = [&key](int j){
+            int m = 0;
+            for(int i = j / 16 * 16; i < j / 16 * 16 + 16; ++i) m += key[i] == key[j];
+            return m;
+        };
+        if(coherence.size()){
+            float* c[2] = { coherence[2 * s].data(), coherence[2 * s + 1].data() };
             for(int j = 0; j < 32; ++j){
-                if(j<16)
-                    sum += net[0][(*iter)[j]];
-                else
-                    sum += net[1][(*iter)[j]];
+                float& ej = c[j / 16][2 * size_t(key[j])];
+                float& aj = c[j / 16][2 * size_t(key[j]) + 1];
+                float rate = (aj > 0) ? std::fabs(ej) / aj : 1;
+                float v = (w[j / 16][key[j]] += amend * rate);
+                gain += rate * occurrences(j);
+                ej += delta;
+                aj += std::fabs(delta);
+                low_weight[j / 16] = std::min(low_weight[j / 16], v); // keep the search bounds valid
+                high_weight[j / 16] = std::max(high_weight[j / 16], v);
             }
-            amend = alpha * ((*rr) + v_as - sum);
-            sum = 0;
-            for(int i = 0; i < 32; ++i){
-                if(i < 16){
-                    net[0][(*iter)[i]] += amend;
-                    sum += net[0][(*iter)[i]];
-                }
-                else{
-                    net[1][(*iter)[i]] += amend;
-                    sum += net[1][(*iter)[i]];
-                }
+        }else{
+            for(int j = 0; j < 32; ++j){
+                float v = (w[j / 16][key[j]] += amend);
+                gain += occurrences(j);
+                low_weight[j / 16] = std::min(low_weight[j / 16], v); // keep the search bounds valid
+                high_weight[j / 16] = std::max(high_weight[j / 16], v);
             }
-            ++iter;
-            ++rr;
         }
-        r.clear();
-        state_key.clear();
-        return;
+        refresh_bounds();
+        return sum + gain * amend;
+    }
+    void prefetch(const std::array<int, 32>& key, int s) const {
+        for(int j = 0; j < 32; ++j) __builtin_prefetch(net[2 * s + j / 16].data() + key[j], 1);
+        if(coherence.empty()) return;
+        for(int j = 0; j < 32; ++j) __builtin_prefetch(coherence[2 * s + j / 16].data() + 2 * size_t(key[j]), 1);
     }
     
 public:
     int hint = 0;
     std::array<int, 3> bag;
+    size_t updates = 0; // afterstates updated by training so far
+
+protected:
+    int depth;
+    int ms;
+    bool online = false;
+    float lambda = 0;
+    std::vector<weight> coherence; // E and A interleaved, a table per table of net (tc=1)
+    std::atomic<float> lower{0}; // the bounds of the network value, read by searches while the watcher of reload= widens them
+    std::atomic<float> ceiling{0};
+    std::array<float, 2> low_weight = {{ 0, 0 }}; // written by training or by the watcher, never both (reload= is read-only)
+    std::array<float, 2> high_weight = {{ 0, 0 }};
     
 private:
     std::vector<int> r;
     std::vector<std::array<int, 32>> state_key;
+    std::vector<int> state_stage;
 };
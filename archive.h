@@ -0,0 +1,244 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#include "weight.h"
+
+/**
+ * sparse weight file, an alternative to the raw format of weight_agent
+ *
+ * most entries of a trained network are still zero, so a table is stored as
+ * chunks of 2^20 entries, each a sequence of runs of non-zero entries:
+ *   varint(zeros skipped) varint(length) float[length]
+ * a run ends at the first entry whose bits are all zero, so the file is
+ * lossless (-0.0f is kept); a chunk may also be deflated (zlib level 1-9)
+ * when that makes it smaller
+ *
+ * layout: magic, version, tables, level (uint32), the length of every table
+ * (uint64), then the bytes and encoded size of every chunk (uint64, the size
+ * is 0 for a stored chunk), then the chunks; as in the raw format, the top
+ * byte of the table count is the order of the entries (weight_agent::arrange)
+ *
+ * chunks are encoded and decoded in parallel; on save, the pages of a table
+ * never touched (not resident and not backed by a file, on a host without
+ * swap) are known to be zero and are not scanned, so a checkpoint costs in proportion to the part
+ * of the network touched; on load, only non-zero runs are written, so the
+ * untouched pages stay unallocated
+ */
+class archive {
+public:
+	static constexpr uint32_t magic = 0x57535054; // "TPSW", never a table count of the raw format
+	static constexpr uint32_t version = 1;
+	static constexpr size_t chunk = 1 << 20;
+
+	/**
+	 * read the header of 'path'; open() is false for a raw file
+	 */
+	archive(const std::string& path) : path(path), valid(false), level(0), order(0) {
+		std::ifstream in(path, std::ios::in | std::ios::binary);
+		uint32_t head[4] = { 0 };
+		if (!in.read(reinterpret_cast<char*>(head), sizeof(head)) || head[0] != magic) return;
+		if (head[1] != version) {
+			std::cerr << path << ": unknown sparse weight version " << head[1] << std::endl;
+			return;
+		}
+		level = head[3];
+		order = head[2] >> 24;
+		length.resize(head[2] & 0xffffff);
+		in.read(reinterpret_cast<char*>(length.data()), sizeof(uint64_t) * length.size());
+		size_t count = 0;
+		for (uint64_t len : length) count += blocks(len);
+		directory.resize(count);
+		in.read(reinterpret_cast<char*>(directory.data()), sizeof(entry) * count);
+		base = size_t(in.tellg());
+		valid = bool(in);
+	}
+
+	bool open() const { return valid; }
+	size_t tables() const { return length.size(); }
+	int layout() const { return order; }
+
+	/**
+	 * decode the tables into net[0..tables()), which must be zero
+	 */
+	bool load(std::vector<weight>& net, size_t threads = 0) const {
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		for (size_t t = 0; t < length.size(); t++) net[t].resize(length[t]);
+		std::vector<size_t> offset(1, base);
+		for (const entry& e : directory) offset.push_back(offset.back() + e.bytes);
+		std::atomic<bool> ok(true);
+		parallel(threads, [&](size_t c) {
+			size_t t, i;
+			locate(c, t, i);
+			std::string data(directory[c].bytes, '\0'), raw;
+			if (pread(fd, &data[0], data.size(), offset[c]) != ssize_t(data.size())) return void(ok = false);
+			if (directory[c].size) {
+				raw.resize(directory[c].size);
+				uLongf size = raw.size();
+				if (uncompress(reinterpret_cast<Bytef*>(&raw[0]), &size, reinterpret_cast<const Bytef*>(data.data()), data.size()) != Z_OK
+					|| size != raw.size()) return void(ok = false);
+				data.swap(raw);
+			}
+			if (!decode(data, net[t].data() + i, std::min(size_t(chunk), length[t] - i))) ok = false;
+		});
+		close(fd);
+		if (!ok) std::cerr << path << ": corrupted sparse weight file" << std::endl;
+		return ok;
+	}
+
+	/**
+	 * encode 'net', whose entries are in 'layout' order, into 'path' (deflated
+	 * at 'level' if level > 0)
+	 */
+	static bool save(const std::string& path, const std::vector<weight>& net, int level = 0, int layout = 0, size_t threads = 0) {
+		archive a(path, net, level);
+		std::vector<std::string> data(a.directory.size());
+		bool swapless = !swapping();
+		a.parallel(threads, [&](size_t c) {
+			size_t t, i;
+			a.locate(c, t, i);
+			std::string raw = encode(net[t], i, std::min(size_t(chunk), net[t].size() - i), swapless);
+			a.directory[c] = { raw.size(), 0 };
+			if (level > 0 && raw.size() > 0) {
+				std::string packed(compressBound(raw.size()), '\0');
+				uLongf size = packed.size();
+				if (compress2(reinterpret_cast<Bytef*>(&packed[0]), &size, reinterpret_cast<const Bytef*>(raw.data()), raw.size(), level) == Z_OK
+					&& size < raw.size()) {
+					packed.resize(size);
+					a.directory[c] = { size, raw.size() };
+					raw.swap(packed);
+				}
+			}
+			data[c].swap(raw);
+		});
+		std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+		uint32_t head[4] = { magic, version, uint32_t(net.size()) | uint32_t(layout) << 24, uint32_t(level) };
+		out.write(reinterpret_cast<const char*>(head), sizeof(head));
+		out.write(reinterpret_cast<const char*>(a.length.data()), sizeof(uint64_t) * a.length.size());
+		out.write(reinterpret_cast<const char*>(a.directory.data()), sizeof(entry) * a.directory.size());
+		for (const std::string& d : data) out.write(d.data(), d.size());
+		out.close();
+		return bool(out);
+	}
+
+private:
+	struct entry {
+		uint64_t bytes; // the bytes in the file
+		uint64_t size; // the bytes before deflating, 0 if stored
+	};
+
+	archive(const std::string& path, const std::vector<weight>& net, int level) : path(path), valid(true), level(level), order(0), base(0) {
+		size_t count = 0;
+		for (const weight& w : net) length.push_back(w.size()), count += blocks(w.size());
+		directory.resize(count);
+	}
+
+	static size_t blocks(size_t len) { return (len + chunk - 1) / chunk; }
+
+	/**
+	 * the table 't' and first entry 'i' of chunk 'c'
+	 */
+	void locate(size_t c, size_t& t, size_t& i) const {
+		for (t = 0; c >= blocks(length[t]); t++) c -= blocks(length[t]);
+		i = c * chunk;
+	}
+
+	template<typename job>
+	void parallel(size_t threads, job work) const {
+		if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+		std::atomic<size_t> next(0);
+		auto run = [&]() { for (size_t c; (c = next++) < directory.size(); ) work(c); };
+		std::vector<std::thread> workers;
+		for (size_t w = 1; w < std::min(threads, directory.size()); w++) workers.emplace_back(run);
+		run();
+		for (std::thread& worker : workers) worker.join();
+	}
+
+	static void put(std::string& out, uint64_t v) {
+		for (; v >= 0x80; v >>= 7) out.push_back(char(v | 0x80));
+		out.push_back(char(v));
+	}
+	static bool get(const std::string& in, size_t& at, uint64_t& v) {
+		v = 0;
+		for (int shift = 0; at < in.size() && shift < 64; shift += 7) {
+			uint8_t b = in[at++];
+			v |= uint64_t(b & 0x7f) << shift;
+			if (!(b & 0x80)) return true;
+		}
+		return false;
+	}
+
+	/**
+	 * whether any swap is active, in which case a page out of memory may
+	 * still hold data
+	 */
+	static bool swapping() {
+		std::ifstream swaps("/proc/swaps");
+		std::string line;
+		size_t lines = 0;
+		while (std::getline(swaps, line)) lines++;
+		return !swaps.eof() || lines > 1; // the first line is the header
+	}
+
+	static std::string encode(const weight& w, size_t from, size_t len, bool swapless) {
+		const uint32_t* bits = reinterpret_cast<const uint32_t*>(w.data()) + from;
+		std::vector<unsigned char> core;
+		size_t page = sysconf(_SC_PAGESIZE), first = 0;
+		if (swapless && !w.backed()) { // the pages of an anonymous table not in memory were never written
+			const char* begin = reinterpret_cast<const char*>(bits);
+			first = size_t(begin) % page;
+			core.resize((first + len * sizeof(float) + page - 1) / page);
+			if (mincore(const_cast<char*>(begin - first), core.size() * page, core.data()) != 0) core.clear();
+		}
+		std::string out;
+		size_t i = 0, last = 0;
+		while (i < len) {
+			if (core.size() && !(core[(first + i * sizeof(float)) / page] & 1)) { // skip to the next page
+				i = ((first + i * sizeof(float)) / page + 1) * page;
+				i = std::min(len, (i - first) / sizeof(float));
+				continue;
+			}
+			if (bits[i] == 0) { i++; continue; }
+			size_t end = i;
+			while (end < len && bits[end] != 0) end++;
+			put(out, i - last);
+			put(out, end - i);
+			out.append(reinterpret_cast<const char*>(bits + i), (end - i) * sizeof(float));
+			last = i = end;
+		}
+		return out;
+	}
+
+	static bool decode(const std::string& in, float* w, size_t len) {
+		size_t at = 0, i = 0;
+		uint64_t skip, count;
+		while (at < in.size()) {
+			if (!get(in, at, skip) || !get(in, at, count)) return false;
+			i += skip;
+			if (i + count > len || at + count * sizeof(float) > in.size()) return false;
+			std::memcpy(w + i, in.data() + at, count * sizeof(float));
+			at += count * sizeof(float);
+			i += count;
+		}
+		return true;
+	}
+
+private:
+	std::string path;
+	bool valid;
+	uint32_t level;
+	int order;
+	size_t base;
+	std::vector<uint64_t> length;
+	std::vector<entry> directory;
+};
@@ -0,0 +1,342 @@
+#pragma once
+#include <vector>
+#include <array>
+#include <chrono>
+#include <numeric>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include "board.h"
+#include "agent.h"
+#include "rng.h"
+#include "profiler.h"
+
+/**
+ * lockstep simulator of K games at once, for evaluating a player (alpha=0)
+ *
+ * the boards are packed into 64 bits (cell i at bits 4i), and every field of
+ * the games is an array over the K slots; each step slides all boards of all
+ * slots by row lookup tables, then evaluates all afterstates together: the
+ * tuple indices of a group of afterstates are computed and prefetched while
+ * the previous group is summed, so the weight loads of many games overlap
+ * a finished game is retired, and its slot is refilled by the next game
+ *
+ * the environment places the hint on a random empty cell of the entry edge,
+ * and draws the next hint from the bag, or a bonus tile with probability 1/21
+ * (same rule as the chance nodes of player::expectimax)
+ *
+ * the games are reproducible from the seed= of the player, and the
+ * afterstates are valued by its eval= (the tuple network, its 16-bit copy,
+ * or the heuristic of the board)
+ *
+ * the result of every block is shown in the format of statistic::show,
+ * where the ops are the slides of the player per second
+ */
+class batch {
+public:
+	typedef uint64_t packed;
+
+	batch(player& play, size_t slots) : play(play), slots(std::max<size_t>(slots, 1)), engine(play.stream(0xba7c)),
+		tiles(this->slots), after(this->slots * 4), reward(this->slots * 4), move(this->slots), value(this->slots),
+		last(this->slots), hint(this->slots), bag(this->slots), placed(this->slots), bonus(this->slots),
+		score(this->slots), steps(this->slots), active(this->slots) {}
+
+	/**
+	 * play 'total' games, showing the statistic of every 'block' games
+	 */
+	void run(size_t total, size_t block) {
+		block = block ? block : total;
+		size_t started = 0, finished = 0;
+		for (size_t k = 0; k < slots && started < total; k++, started++) start(k);
+		from = clock::now();
+		while (finished < total) {
+			slide();
+			decide();
+			for (size_t k = 0; k < slots; k++) {
+				if (!active[k]) continue;
+				if (move[k] == -1) {
+					record(k);
+					active[k] = false;
+					if (++finished % block == 0 || finished == total) show(block);
+					if (started < total) start(k), started++;
+					continue;
+				}
+				tiles[k] = after[k * 4 + move[k]];
+				score[k] += reward[k * 4 + move[k]];
+				last[k] = move[k];
+				steps[k]++;
+				place(k);
+			}
+		}
+	}
+
+public:
+	static packed pack(const board& b) {
+		packed x = 0;
+		for (int i = 0; i < 16; i++) x |= packed(b(i) & 15) << (4 * i);
+		return x;
+	}
+	static int at(packed x, int i) { return (x >> (4 * i)) & 15; }
+
+	static packed transpose(packed x) {
+		packed a1 = x & 0xf0f00f0ff0f00f0full;
+		packed a2 = x & 0x0000f0f00000f0f0ull;
+		packed a3 = x & 0x0f0f00000f0f0000ull;
+		packed a = a1 | (a2 << 12) | (a3 >> 12);
+		packed b1 = a & 0xff00ff0000ff00ffull;
+		packed b2 = a & 0x00ff00ff00000000ull;
+		packed b3 = a & 0x00000000ff00ff00ull;
+		return b1 | (b2 >> 24) | (b3 << 24);
+	}
+
+	/**
+	 * slide a packed board by opcode, return the reward or -1 if nothing moves
+	 */
+	static int slide(packed x, int op, packed& out) {
+		const table& t = rows();
+		bool left = (op == 0 || op == 3);
+		bool column = (op == 0 || op == 2);
+		packed y = column ? transpose(x) : x, z = 0;
+		int r = 0;
+		for (int i = 0; i < 4; i++) {
+			unsigned row = (y >> (16 * i)) & 0xffff;
+			z |= packed(left ? t.left[row] : t.right[row]) << (16 * i);
+			r += left ? t.gain_left[row] : t.gain_right[row];
+		}
+		out = column ? transpose(z) : z;
+		return (out == x) ? -1 : r;
+	}
+
+	static board unpack(packed x) {
+		board b;
+		for (int i = 0; i < 16; i++) b(i) = at(x, i);
+		return b;
+	}
+
+	static int max_tile(packed x) {
+		int m = 0;
+		for (int i = 0; i < 16; i++) m = std::max(m, at(x, i));
+		return m;
+	}
+
+private:
+	struct table {
+		uint16_t left[65536], right[65536];
+		int gain_left[65536], gain_right[65536];
+	};
+
+	/**
+	 * the row tables are built by board::slide_left/right, so the packed
+	 * slides follow exactly the rules of the board
+	 */
+	static const table& rows() {
+		static const table& t = build();
+		return t;
+	}
+	static const table& build() {
+		static table t;
+		for (unsigned row = 0; row < 65536; row++) {
+			for (int dir = 0; dir < 2; dir++) {
+				board b;
+				for (int c = 0; c < 4; c++) b(c) = (row >> (4 * c)) & 15;
+				int r = dir ? b.slide_right() : b.slide_left();
+				unsigned res = 0;
+				for (int c = 0; c < 4; c++) res |= unsigned(b(c)) << (4 * c);
+				(dir ? t.right : t.left)[row] = res;
+				(dir ? t.gain_right : t.gain_left)[row] = (r == -1) ? 0 : r;
+			}
+		}
+		return t;
+	}
+
+	int draw(size_t k) {
+		std::array<int, 3>& b = bag[k];
+		if (b[0] + b[1] + b[2] == 0) b = {{ 4, 4, 4 }};
+		int i = engine.below(b[0] + b[1] + b[2]);
+		int tile = (i < b[0]) ? 0 : (i < b[0] + b[1]) ? 1 : 2;
+		--b[tile];
+		return tile + 1;
+	}
+
+	void start(size_t k) {
+		tiles[k] = 0;
+		last[k] = -1;
+		bag[k] = {{ 4, 4, 4 }};
+		placed[k] = bonus[k] = score[k] = 0;
+		steps[k] = 0;
+		active[k] = true;
+		for (int n = 0; n < 9; n++) {
+			int pos;
+			do pos = engine.below(16); while (at(tiles[k], pos) != 0);
+			tiles[k] |= packed(draw(k)) << (4 * pos);
+		}
+		hint[k] = draw(k);
+	}
+
+	/**
+	 * the environment: place the hint on the entry edge, then draw the next
+	 */
+	void place(size_t k) {
+		static const unsigned edge[4] = { 0xf000, 0x1111, 0x000f, 0x8888 };
+		int cells[4], n = 0;
+		for (unsigned m = edge[last[k]]; m; m &= m - 1) {
+			int pos = __builtin_ctz(m);
+			if (at(tiles[k], pos) == 0) cells[n++] = pos;
+		}
+		int max = max_tile(tiles[k]);
+		int tile = (hint[k] < 4) ? hint[k] : 4 + engine.below(std::max(4, max - 3) - 4 + 1);
+		if (n) tiles[k] |= packed(tile) << (4 * cells[engine.below(n)]);
+		placed[k]++;
+		bool allowed = max > 6 && (bonus[k] + 1) * 21 <= placed[k] + 1;
+		if (allowed && engine.below(21) == 0) {
+			hint[k] = 4;
+			bonus[k]++;
+		} else {
+			hint[k] = draw(k);
+		}
+	}
+
+	/**
+	 * slide every active board in all four directions
+	 */
+	void slide() {
+		for (size_t k = 0; k < slots; k++) {
+			if (!active[k]) continue;
+			for (int op = 0; op < 4; op++) reward[k * 4 + op] = slide(tiles[k], op, after[k * 4 + op]);
+		}
+	}
+
+	/**
+	 * choose the best slide of every active slot by reward plus afterstate
+	 * value, as player::decide does; the 'group' afterstates ahead of the one
+	 * being summed have their indices computed and their weights prefetched
+	 * (in the 16-bit copy with eval=quantized, and none with eval=heuristic)
+	 */
+	void decide() {
+		weight_agent::reading pin(play);
+		const std::vector<weight>& w = play.tables();
+		const quantized* q = (play.evaluation == weight_agent::by_quantized) ? play.coarse.get() : nullptr;
+		bool keyed = play.evaluation != weight_agent::by_heuristic;
+		todo.clear();
+		for (size_t k = 0; k < slots; k++) {
+			move[k] = -1;
+			if (!active[k]) continue;
+			for (int op = 0; op < 4; op++) if (reward[k * 4 + op] != -1) todo.push_back(k * 4 + op);
+		}
+		index.resize(todo.size());
+		stage.resize(todo.size());
+		auto prepare = [&](size_t i) {
+			if (!keyed) return;
+			size_t k = todo[i] / 4;
+			int op = todo[i] % 4;
+			packed x = after[todo[i]];
+			int offset = play.span * (4 * op + hint[k] - 1);
+			stage[i] = play.staged(max_tile(x)); // not counted, only the moves played are (stage)
+			for (int j = 0; j < 32; j++) {
+				const int* p = play.pattern[j];
+				index[i][j] = offset + play.stride * (at(x, p[0]) + at(x, p[1]) * 15 + at(x, p[2]) * 225
+					+ at(x, p[3]) * 3375 + at(x, p[4]) * 50625 + at(x, p[5]) * 759375);
+				if (q) __builtin_prefetch(q->data(2 * stage[i] + j / 16) + index[i][j]);
+				else __builtin_prefetch(&w[2 * stage[i] + j / 16][index[i][j]]);
+			}
+		};
+		auto sum = [&](size_t i) -> float {
+			if (!keyed) return weight_agent::heuristic(unpack(after[todo[i]])); // timed by heuristic itself
+			profiler::scope timer(profiler::eval);
+			if (q) {
+				int part[2] = { 0, 0 };
+				for (int j = 0; j < 32; j++) part[j / 16] += q->data(2 * stage[i] + j / 16)[index[i][j]];
+				return part[0] * q->scale(2 * stage[i]) + part[1] * q->scale(2 * stage[i] + 1);
+			}
+			float v = 0;
+			for (int j = 0; j < 32; j++) v += w[2 * stage[i] + j / 16][index[i][j]];
+			return v;
+		};
+		const size_t group = 16;
+		for (size_t i = 0; i < std::min(group, todo.size()); i++) prepare(i);
+		for (size_t i = 0; i < todo.size(); i++) {
+			if (i + group < todo.size()) prepare(i + group);
+			float v = reward[todo[i]] + sum(i);
+			size_t k = todo[i] / 4;
+			if (move[k] == -1 || v > value[k]) {
+				value[k] = v;
+				move[k] = todo[i] % 4;
+			}
+		}
+	}
+
+	void record(size_t k) {
+		stat.push_back({ score[k], max_tile(tiles[k]), steps[k] });
+	}
+
+	void show(size_t block) {
+		size_t blk = std::min(stat.size(), block);
+		size_t count[16] = { 0 };
+		size_t sop = 0;
+		board::reward sum = 0, max = 0;
+		for (auto it = stat.end() - blk; it != stat.end(); ++it) {
+			sum += it->score;
+			max = std::max(it->score, max);
+			count[it->tile]++;
+			sop += it->steps;
+		}
+		auto now = clock::now();
+		double sdu = std::chrono::duration_cast<std::chrono::microseconds>(now - from).count() / 1000.0;
+		from = now;
+
+		std::ios ff(nullptr);
+		ff.copyfmt(std::cout);
+		std::cout << std::fixed << std::setprecision(0);
+		std::cout << stat.size() << "\t";
+		std::cout << "avg = " << (sum / blk) << ", ";
+		std::cout << "max = " << (max) << ", ";
+		std::cout << "ops = " << (sop * 1000.0 / std::max(sdu, 1e-3));
+		std::cout << " (" << slots << " slots)";
+		std::cout << std::endl;
+		std::cout.copyfmt(ff);
+		profiler::report(std::cout);
+
+		for (size_t t = 0, c = 0; c < blk; c += count[t++]) {
+			if (count[t] == 0) continue;
+			unsigned accu = std::accumulate(std::begin(count) + t, std::end(count), 0);
+			int k = (t > 3) ? (1 << (t-3) & -2u)*3 : t;
+			std::cout << "\t" << k; // type
+			std::cout << "\t" << (accu * 100.0 / blk) << "%"; // win rate
+			std::cout << "\t" "(" << (count[t] * 100.0 / blk) << "%" ")"; // percentage of ending
+			std::cout << std::endl;
+		}
+		std::cout << std::endl;
+	}
+
+private:
+	typedef std::chrono::steady_clock clock;
+	struct result {
+		board::reward score;
+		int tile;
+		size_t steps;
+	};
+
+	player& play;
+	size_t slots;
+	rng engine;
+
+	std::vector<packed> tiles;
+	std::vector<packed> after; // 4 afterstates per slot
+	std::vector<int> reward; // 4 rewards per slot, -1 if illegal
+	std::vector<int> move;
+	std::vector<float> value;
+	std::vector<int> last;
+	std::vector<int> hint; // 1-3, or 4 for a bonus tile
+	std::vector<std::array<int, 3>> bag;
+	std::vector<int> placed;
+	std::vector<int> bonus;
+	std::vector<board::reward> score;
+	std::vector<size_t> steps;
+	std::vector<char> active;
+
+	std::vector<size_t> todo;
+	std::vector<std::array<int, 32>> index;
+	std::vector<int> stage; // the stage of each afterstate in todo
+	std::vector<result> stat;
+	clock::time_point from;
+};
@@ -2,6 +2,7 @@
 #include <array>
 #include <iostream>
 #include <iomanip>
+#include "profiler.h"
 
 /**
  * array-based board for threes
@@ -59,6 +60,7 @@ public:
 	 * return the reward of the action, or -1 if the action is illegal
 	 */
 	reward slide(unsigned opcode){
+		profiler::scope timer(profiler::slide);
 		switch (opcode & 0b11){
 		case 0: return slide_up();
 		case 1: return slide_right();
@@ -126,6 +128,40 @@ public:
 		return score;
 	}
 
+	/**
+	 * legal slides as a bit mask, bit i set if slide(i) would change the board
+	 * answered from a row lookup table, without trial slides
+	 */
+	unsigned movable() const {
+		unsigned mask = 0;
+		for(int i = 0; i < 4; i++){
+			unsigned r = moves()[tile[i][0] | tile[i][1] << 4 | tile[i][2] << 8 | tile[i][3] << 12];
+			unsigned c = moves()[tile[0][i] | tile[1][i] << 4 | tile[2][i] << 8 | tile[3][i] << 12];
+			mask |= ((r & 1) << 3) | ((r & 2) ? 0b0010 : 0) | (c & 1) | ((c & 2) ? 0b0100 : 0);
+		}
+		return mask;
+	}
+
+	/**
+	 * empty cells where the next tile may be placed, as a bit mask of 1-d indices
+	 * the entry edge is opposite to the last slide (e.g. the bottom row after
+	 * sliding up); any empty cell is a candidate if there is no last slide
+	 */
+	unsigned placeable() const {
+		static const unsigned edge[4] = { 0xf000, 0x1111, 0x000f, 0x8888 };
+		unsigned mask = (last >= 0 && last < 4) ? edge[last] : 0xffff;
+		for(unsigned m = mask; m; m &= m - 1){
+			int pos = __builtin_ctz(m);
+			if(operator()(pos) != 0) mask &= ~(1u << pos);
+		}
+		return mask;
+	}
+
+	/**
+	 * the reward of a merge into tile index t (5 for the 1+2 merge into a 3)
+	 */
+	reward merge_reward(cell t) const { return t == 3 ? 5 : grade[t & 15]; }
+
 	void transpose(){
 		for(int r = 0; r < 4; ++r){
 			for (int c = r + 1; c < 4; ++c){
@@ -174,6 +210,30 @@ public:
     int max = 0;
     std::array<int,3> bag;
     
+private:
+	/**
+	 * for every row (4 tiles of 4 bits, index 0 at the lowest bits),
+	 * bit 0 is set if the row can slide toward index 0, bit 1 toward index 3
+	 */
+	static const std::array<uint8_t, 65536>& moves(){
+		static std::array<uint8_t, 65536> table = build_moves();
+		return table;
+	}
+	static std::array<uint8_t, 65536> build_moves(){
+		std::array<uint8_t, 65536> table;
+		auto merge = [](int a, int b){ return (a == b && a > 2) || (a + b == 3 && a * b == 2); };
+		for(unsigned key = 0; key < 65536; key++){
+			int t[4] = { int(key & 15), int(key >> 4 & 15), int(key >> 8 & 15), int(key >> 12 & 15) };
+			uint8_t can = 0;
+			for(int c = 1; c < 4; c++){
+				if(t[c] != 0 && (t[c-1] == 0 || merge(t[c-1], t[c]))) can |= 1;
+				if(t[c-1] != 0 && (t[c] == 0 || merge(t[c], t[c-1]))) can |= 2;
+			}
+			table[key] = can;
+		}
+		return table;
+	}
+
 private:
 	grid tile;
     std::array<int,16> grade;
@@ -0,0 +1,152 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <array>
+#include <fstream>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include "board.h"
+#include "rng.h"
+
+/**
+ * opening book for the replies of the environment
+ *
+ * maps an early decision of rndenv, i.e. the board after the slide, the tile
+ * to place, the bag and whether a bonus tile is allowed, to the reply its
+ * search chose; a book is built by an environment playing with openings=N,
+ * which records its first N searched replies of every game, so the book
+ * holds the states that games actually reach (e.g. the fixed seeds of a
+ * benchmark or of a tournament), and it is only valid for the weights and
+ * search options (depth 7 or mcts=) it was built with
+ *
+ * the table is open addressing over 64-bit entries, the upper 48 bits of the
+ * hash (which also select the slot) followed by the position and the next
+ * hint; the file is a header (magic, version, plies, capacity, count) and the table
+ * as it is in memory
+ */
+class book {
+public:
+	static constexpr uint32_t magic = 0x4b425054; // "TPBK"
+	static constexpr uint32_t version = 1;
+
+	/**
+	 * a table holding up to 'limit' entries (at most half full)
+	 */
+	book(size_t limit = 0) : count(0), limit(limit), depth(0) {
+		size_t size = 1;
+		while (size < 2 * limit) size <<= 1;
+		table.assign(limit ? size : 0, 0);
+	}
+
+	size_t size() const { return count; }
+	int plies() const { return depth; } // the early decisions of a game the book covers
+	bool full() const { return count >= limit; }
+
+	bool probe(const board& before, const std::array<int, 3>& bag, int previous, bool bonus, int& at, int& now) const {
+		if (table.empty()) return false;
+		uint64_t h = hash(before, bag, previous, bonus);
+		for (size_t i = slot(h); table[i]; i = (i + 1) & (table.size() - 1)) {
+			if ((table[i] >> 16) != (h >> 16)) continue;
+			at = (table[i] >> 8) & 0xff;
+			now = table[i] & 0xff;
+			return true;
+		}
+		return false;
+	}
+
+	/**
+	 * record the reply to the 'ply'-th decision of a game
+	 */
+	void store(int ply, const board& before, const std::array<int, 3>& bag, int previous, bool bonus, int at, int now) {
+		if (full()) return;
+		depth = std::max(depth, ply + 1);
+		uint64_t h = hash(before, bag, previous, bonus);
+		size_t i = slot(h);
+		for (; table[i]; i = (i + 1) & (table.size() - 1)) {
+			if ((table[i] >> 16) == (h >> 16)) return;
+		}
+		table[i] = (h >> 16 << 16) | uint64_t(at & 0xff) << 8 | uint64_t(now & 0xff);
+		count++;
+	}
+
+	/**
+	 * read a book; the table keeps the capacity of the file, and can take
+	 * new entries up to the limit given to the constructor
+	 */
+	bool load(const std::string& path) {
+		std::ifstream in(path, std::ios::in | std::ios::binary);
+		uint32_t head[4] = { 0 };
+		uint64_t size = 0, entries = 0;
+		in.read(reinterpret_cast<char*>(head), sizeof(head));
+		in.read(reinterpret_cast<char*>(&size), sizeof(size));
+		in.read(reinterpret_cast<char*>(&entries), sizeof(entries));
+		if (!in || head[0] != magic || head[1] != version || (size & (size - 1))) return false;
+		table.assign(size, 0);
+		in.read(reinterpret_cast<char*>(table.data()), sizeof(uint64_t) * size);
+		count = entries;
+		depth = head[2];
+		limit = std::max(limit, std::min(count, size_t(size / 2)));
+		if (table.size() < 2 * limit) rehash();
+		return bool(in);
+	}
+
+	/**
+	 * write the book, shrunk to the capacity its entries need
+	 */
+	bool save(const std::string& path) const {
+		book copy(count);
+		copy.count = count;
+		copy.depth = depth;
+		for (uint64_t e : table) if (e) copy.insert(e);
+		if (copy.table.size() < table.size()) return copy.save(path);
+		std::string temp = path + ".tmp";
+		std::ofstream out(temp, std::ios::out | std::ios::binary | std::ios::trunc);
+		uint32_t head[4] = { magic, version, uint32_t(depth), 0 };
+		uint64_t size = table.size(), entries = count;
+		out.write(reinterpret_cast<const char*>(head), sizeof(head));
+		out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+		out.write(reinterpret_cast<const char*>(&entries), sizeof(entries));
+		out.write(reinterpret_cast<const char*>(table.data()), sizeof(uint64_t) * size);
+		out.close();
+		return out && std::rename(temp.c_str(), path.c_str()) == 0;
+	}
+
+private:
+	static uint64_t hash(const board& before, const std::array<int, 3>& bag, int previous, bool bonus) {
+		uint64_t tiles = 0;
+		for (int i = 0; i < 16; i++) tiles |= uint64_t(before(i) & 15) << (4 * i);
+		uint64_t state = uint64_t(before.last + 1) | uint64_t(previous & 15) << 4 | uint64_t(before.max & 15) << 8
+			| uint64_t(bonus) << 12 | uint64_t(bag[0] & 15) << 16 | uint64_t(bag[1] & 15) << 20 | uint64_t(bag[2] & 15) << 24;
+		uint64_t h = rng(tiles, state)();
+		return (h >> 16) ? h : (h | 1ull << 16); // an entry is never 0
+	}
+
+	/**
+	 * grow the table to hold 'limit' entries
+	 */
+	void rehash() {
+		std::vector<uint64_t> old;
+		old.swap(table);
+		size_t size = 1;
+		while (size < 2 * limit) size <<= 1;
+		table.assign(size, 0);
+		for (uint64_t e : old) if (e) insert(e);
+	}
+	void insert(uint64_t e) {
+		size_t i = slot(e);
+		while (table[i]) i = (i + 1) & (table.size() - 1);
+		table[i] = e;
+	}
+
+	/**
+	 * the home slot, from the bits of the hash kept in the entry
+	 */
+	size_t slot(uint64_t h) const { return (h >> 16) & (table.size() - 1); }
+
+private:
+	std::vector<uint64_t> table;
+	size_t count;
+	size_t limit;
+	int depth;
+};
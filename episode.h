@@ -12,10 +12,91 @@
 
 class statistic;
 
+/**
+ * compact move records of an episode
+ *
+ * a move is the 8-bit event of its action and a 32-bit time in milliseconds:
+ * a slide is its opcode (0-3), a placement its position plus tile << 4,
+ * which is at least 16 since no empty tile is placed; rewards are not
+ * stored, as replaying the actions from the initial board gives them back
+ *
+ * records are stored in fixed-size chunks, which go back to the free list of
+ * the calling thread when an episode is dropped (e.g. by the 'limit' of
+ * statistic), so that new episodes reuse them instead of growing the heap;
+ * the lists are per thread, as the workers of a tournament play their own
+ * episodes concurrently
+ */
+class history {
+public:
+	history() : count(0) {}
+	history(const history& h) : history() { operator =(h); }
+	history(history&& h) : history() { swap(h); }
+	~history() { clear(); }
+
+	history& operator =(const history& h) {
+		if (this == &h) return *this;
+		clear();
+		for (size_t i = 0; i < h.size(); i++) push_back(h.at(i), h.time(i));
+		return *this;
+	}
+	history& operator =(history&& h) { swap(h); return *this; }
+
+	size_t size() const { return count; }
+
+	void push_back(action move, time_t time) {
+		if (count % chunk::length == 0) chunks.push_back(allocate());
+		chunk* c = chunks[count / chunk::length];
+		c->code[count % chunk::length] = move.event();
+		c->time[count % chunk::length] = std::min<time_t>(std::max<time_t>(time, 0), UINT32_MAX);
+		count++;
+	}
+	action at(size_t i) const {
+		unsigned code = chunks[i / chunk::length]->code[i % chunk::length];
+		if (code < 16) return action::slide(code);
+		return action::place(code & 0x0f, code >> 4);
+	}
+	time_t time(size_t i) const { return chunks[i / chunk::length]->time[i % chunk::length]; }
+
+	void clear() {
+		for (chunk* c : chunks) spare().push_back(c);
+		chunks.clear();
+		count = 0;
+	}
+	void swap(history& h) {
+		std::swap(chunks, h.chunks);
+		std::swap(count, h.count);
+	}
+
+private:
+	struct chunk {
+		static constexpr size_t length = 64;
+		uint32_t time[length];
+		uint8_t code[length];
+	};
+
+	struct pool {
+		std::vector<chunk*> list;
+		~pool() { for (chunk* c : list) delete c; }
+	};
+	static std::vector<chunk*>& spare() {
+		static thread_local pool free;
+		return free.list;
+	}
+	static chunk* allocate() {
+		if (spare().empty()) return new chunk;
+		chunk* c = spare().back();
+		spare().pop_back();
+		return c;
+	}
+
+	std::vector<chunk*> chunks;
+	size_t count;
+};
+
 class episode {
 friend class statistic;
 public:
-	episode() : ep_state(initial_state()), ep_score(0), ep_time(0) { ep_moves.reserve(10000); }
+	episode() : ep_state(initial_state()), ep_score(0), ep_time(0) {}
 
 public:
 	board& state() { return ep_state; }
@@ -31,7 +112,7 @@ public:
 	bool apply_action(action move) {
 		board::reward reward = move.apply(state());
 		if (reward == -1) return false;
-		ep_moves.emplace_back(move, reward, millisec() - ep_time);
+		ep_moves.push_back(move, millisec() - ep_time);
 		ep_score += reward;
 		return true;
 	}
@@ -58,10 +139,10 @@ public:
 		size_t i = 2;
 		switch (who) {
 		case action::place::type:
-			if (ep_moves.size()) time += ep_moves[0].time, i = 1;
+			if (ep_moves.size()) time += ep_moves.time(0), i = 1;
 			// no break;
 		case action::slide::type:
-			while (i < ep_moves.size()) time += ep_moves[i].time, i += 2;
+			while (i < ep_moves.size()) time += ep_moves.time(i), i += 2;
 			break;
 		default:
 			time = ep_close.when - ep_open.when;
@@ -75,13 +156,13 @@ public:
 		size_t i = 2;
 		switch (who) {
 		case action::place::type:
-			if (ep_moves.size()) res.push_back(ep_moves[0]), i = 1;
+			if (ep_moves.size()) res.push_back(ep_moves.at(0)), i = 1;
 			// no break;
 		case action::slide::type:
-			while (i < ep_moves.size()) res.push_back(ep_moves[i]), i += 2;
+			while (i < ep_moves.size()) res.push_back(ep_moves.at(i)), i += 2;
 			break;
 		default:
-			res.assign(ep_moves.begin(), ep_moves.end());
+			for (i = 0; i < ep_moves.size(); i++) res.push_back(ep_moves.at(i));
 			break;
 		}
 		return res;
@@ -91,7 +172,11 @@ public:
 
 	friend std::ostream& operator <<(std::ostream& out, const episode& ep) {
 		out << ep.ep_open << '|';
-		for (const move& mv : ep.ep_moves) out << mv;
+		board state = initial_state();
+		for (size_t i = 0; i < ep.ep_moves.size(); i++) {
+			action code = ep.ep_moves.at(i);
+			out << move(code, code.apply(state), ep.ep_moves.time(i));
+		}
 		out << '|' << ep.ep_close;
 		return out;
 	}
@@ -102,9 +187,12 @@ public:
 		std::stringstream(token) >> ep.ep_open;
 		std::getline(in, token, '|');
 		for (std::stringstream moves(token); !moves.eof(); moves.peek()) {
-			ep.ep_moves.emplace_back();
-			moves >> ep.ep_moves.back();
-			ep.ep_score += action(ep.ep_moves.back()).apply(ep.ep_state);
+			move mv;
+			moves >> mv;
+			unsigned type = action(mv).type();
+			if (type != action::slide::type && type != action::place::type) break;
+			ep.ep_moves.push_back(mv, mv.time);
+			ep.ep_score += action(mv).apply(ep.ep_state);
 		}
 		std::getline(in, token, '|');
 		std::stringstream(token) >> ep.ep_close;
@@ -168,7 +256,7 @@ protected:
 private:
 	board ep_state;
 	board::reward ep_score;
-	std::vector<move> ep_moves;
+	history ep_moves;
 	time_t ep_time;
 
 	meta ep_open;
@@ -10,20 +10,33 @@
 #include <fstream>
 #include <iterator>
 #include <string>
+#include <cstdio>
 #include "board.h"
 #include "action.h"
 #include "agent.h"
 #include "episode.h"
 #include "statistic.h"
+#include "profiler.h"
+#include "server.h"
+#include "batch.h"
+#include "metrics.h"
+#include "tournament.h"
+
+void save_statistic(const statistic& stat, const std::string& path){
+	std::string temp = path + ".tmp";
+	std::ofstream out(temp, std::ios::out | std::ios::trunc);
+	out << stat;
+	out.close();
+	std::rename(temp.c_str(), path.c_str());
+}
 
 int main(int argc, const char* argv[]){
-	std::cout << "threes-Demo: ";
-	std::copy(argv, argv + argc, std::ostream_iterator<const char*>(std::cout, " "));
-	std::cout << std::endl << std::endl;
-	size_t total = 1000, block = 0, limit = 0;
+	size_t total = 1000, block = 0, limit = 0, threads = 0, slots = 0;
 	std::string play_args, evil_args;
-	std::string load, save;
-	bool summary = false;
+	std::string load, save, serve, monitor, convert;
+	std::vector<std::string> weights;
+	double period = 0, goal = 0;
+	bool summary = false, serving = false;
 	for(int i = 1; i < argc; ++i){
 		std::string para(argv[i]);
 		if(para.find("--total=") == 0){
@@ -42,9 +55,56 @@ int main(int argc, const char* argv[]){
 			save = para.substr(para.find("=") + 1);
 		}else if(para.find("--summary") == 0){
 			summary = true;
+		}else if(para.find("--profile") == 0){
+			profiler::enabled() = true;
+		}else if(para.find("--perf") == 0){
+			profiler::enabled() = true;
+			profiler::perf() = true;
+		}else if(para.find("--threads=") == 0){
+			threads = std::stoull(para.substr(para.find("=") + 1));
+		}else if(para.find("--serve") == 0){
+			serving = true;
+			if(para.find("=") != std::string::npos) serve = para.substr(para.find("=") + 1);
+		}else if(para.find("--metrics=") == 0){
+			monitor = para.substr(para.find("=") + 1);
+		}else if(para.find("--period=") == 0){
+			period = std::stod(para.substr(para.find("=") + 1));
+		}else if(para.find("--tournament=") == 0){
+			std::stringstream list(para.substr(para.find("=") + 1));
+			for(std::string path; std::getline(list, path, ','); ) if(path.size()) weights.push_back(path);
+		}else if(para.find("--target=") == 0){
+			goal = std::stod(para.substr(para.find("=") + 1));
+		}else if(para.find("--convert=") == 0){
+			convert = para.substr(para.find("=") + 1);
+		}else if(para.find("--batch=") == 0){
+			slots = std::stoull(para.substr(para.find("=") + 1));
 		}
 	}
+	std::ostream& banner = (serving && (serve.empty() || serve == "-")) ? std::cerr : std::cout; // keep stdout for answers
+	banner << "threes-Demo: ";
+	std::copy(argv, argv + argc, std::ostream_iterator<const char*>(banner, " "));
+	banner << std::endl << std::endl;
+	if(serving){
+		player play(play_args);
+		server(play, threads).serve(serve);
+		return 0;
+	}
+	if(convert.find(',') != std::string::npos){ // the format of the output follows format= of --play
+		std::string from = convert.substr(0, convert.find(',')), to = convert.substr(convert.find(',') + 1);
+		player(play_args + " load=" + from + " save=" + to + " alpha=0");
+		return 0;
+	}
+	if(weights.size()){
+		tournament(weights, play_args, evil_args, total, block, threads).run();
+		return 0;
+	}
+	if(slots){
+		player play(play_args);
+		batch(play, slots).run(total, block);
+		return 0;
+	}
 	statistic stat(total, block, limit);
+	stat.target(goal);
 	if(load.size()){
 		std::ifstream in(load, std::ios::in);
 		in >> stat;
@@ -52,7 +112,9 @@ int main(int argc, const char* argv[]){
 		summary |= stat.is_finished();
 	}
 	player play(play_args);
+	play.resume(stat.episodes());
 	rndenv evil(evil_args);
+	metrics metric(monitor, block ? block : total, period);
 	while(!stat.is_finished()){
 		play.open_episode("~:" + evil.name());
 		evil.open_episode(play.name() + ":~");
@@ -60,7 +122,13 @@ int main(int argc, const char* argv[]){
 		episode& game = stat.back();
 		while(true){
             agent& who = game.take_turns(play, evil);
+			if(&who == &play) evil.ponder(game.state());
+			auto from = std::chrono::steady_clock::now();
 			action move = who.take_action(game.state());
+			if(metric.enabled()){
+				auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - from).count();
+				metric.move(&who == &play ? metrics::play : metrics::evil, ns);
+			}
         
 			if(evil.now > 3) play.hint = 4;
             else play.hint = evil.now;
@@ -73,18 +141,24 @@ int main(int argc, const char* argv[]){
 		}
 		agent& win = game.last_turns(play, evil);
 		stat.close_episode(win.name());
+		if(stat.episodes() % (block ? block : total) == 0) play.report_stages(std::cout);
 		play.close_episode(win.name());
 		evil.close_episode(win.name());
 		evil.reset();
 		play.training();
+		if(metric.enabled()){
+			metric.episode(game.score(), game.state().max);
+			metric.flush(stat.episodes(), play.updates, play);
+		}
+		play.checkpoint([&](){ if(save.size()) save_statistic(stat, save); });
 	}
+	play.wait_checkpoint();
+	metric.flush(stat.episodes(), play.updates, play, true);
 	if(summary){
 		stat.summary();
 	}
 	if(save.size()){
-		std::ofstream out(save, std::ios::out | std::ios::trunc);
-		out << stat;
-		out.close();
+		save_statistic(stat, save);
 	}
 	return 0;
 }
@@ -0,0 +1,294 @@
+#pragma once
+#include <vector>
+#include <array>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include "board.h"
+#include "rng.h"
+
+/**
+ * monte carlo tree search for the reply of the environment
+ *
+ * an anytime alternative to the fixed-depth alpha-beta of rndenv: the root is
+ * the afterstate to be answered, the environment chooses a position and the
+ * next hint, the player a slide; values are the rewards of the player plus the
+ * value of the last state, which the environment minimizes
+ *  - selection is UCT, with the values normalized by the range seen so far
+ *  - a node is expanded on its first visit, and valued by the network
+ *    (the best slide by reward plus afterstate value for the player to move),
+ *    or by 'rollout' random plies followed by the network
+ *  - a player with no legal slide is worth -1, as in the minimax
+ *  - the search stops when the node budget is used up (as playouts or as
+ *    nodes allocated, whichever is first), or at the deadline
+ *  - with workers > 1, the threads share the tree under a lock, and a
+ *    virtual loss keeps them from following the same path
+ *
+ * nodes are allocated from an arena, a vector reserved to the node budget
+ * that each thread keeps between searches; the children of a node are
+ * contiguous, and a node only records its edge, so the boards are replayed
+ * from the root while descending
+ */
+class mcts {
+public:
+	struct budget {
+		size_t nodes = 1 << 20;
+		int ms = 0; // 0 for no deadline
+		size_t workers = 1;
+		int rollout = 0; // random plies before the leaf is valued
+		float explore = 0.5; // the UCT constant
+		uint64_t seed = 0; // the seed= of the searching agent, which the random streams of the workers derive from
+	};
+	struct choice {
+		int at;
+		int hint;
+	};
+
+	mcts(const budget& limit) : limit(limit) { this->limit.nodes = std::max<size_t>(this->limit.nodes, 1); }
+
+	/**
+	 * choose where to place 'previous' on 'before', and the next hint
+	 * 'estimate' is the afterstate value, 'stop' may abandon the search
+	 */
+	template<typename value>
+	choice search(const board& before, const std::array<int, 3>& bag, int previous, bool bonus,
+			value estimate, const std::atomic<bool>* stop = nullptr) {
+		std::vector<node>& arena = pool();
+		arena.clear();
+		if (arena.capacity() < limit.nodes) arena.reserve(limit.nodes);
+		root = before;
+		root.type = 'a';
+		root.hint = previous;
+		root.bag = bag;
+		this->bonus = bonus;
+		lo = 0, hi = 0;
+		seen = false;
+		deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(limit.ms);
+		this->stop = stop;
+		arena.push_back(node());
+		tree = &arena;
+
+		std::vector<std::thread> workers;
+		for (size_t w = 1; w < limit.workers; w++) {
+			workers.emplace_back([this, w, &estimate]() { run(w, estimate); });
+		}
+		run(0, estimate);
+		for (std::thread& worker : workers) worker.join();
+
+		const node& top = arena[0];
+		choice best = { 100, previous };
+		int visits = -1;
+		float mean = 0;
+		for (int c = top.first; c >= 0 && c < top.first + top.count; c++) {
+			const node& n = arena[c];
+			float q = n.visits ? n.sum / n.visits : 0;
+			if (n.visits > visits || (n.visits == visits && q < mean)) {
+				visits = n.visits;
+				mean = q;
+				best = { n.move, n.hint };
+			}
+		}
+		return best;
+	}
+
+private:
+	struct node {
+		float sum = 0; // the returns seen from the parent, including 'reward'
+		int visits = 0;
+		int first = -1; // the first child in the arena, -1 if not expanded
+		int count = 0;
+		float reward = 0;
+		int8_t move = -1; // the slide, or the position of the environment
+		int8_t hint = 0; // the next hint announced with the position
+		bool terminal = false;
+	};
+
+	static std::vector<node>& pool() {
+		static thread_local std::vector<node> arena;
+		return arena;
+	}
+
+	bool expired() const {
+		if (stop && stop->load(std::memory_order_relaxed)) return true;
+		return limit.ms > 0 && std::chrono::steady_clock::now() > deadline;
+	}
+
+	template<typename value>
+	void run(size_t w, value& estimate) {
+		rng engine(limit.seed ^ 0x3c75, w); // apart from the streams of random_agent::stream
+		std::vector<std::pair<int, float>> path;
+		board state;
+		while (!expired()) {
+			path.clear();
+			bool leaf = false;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (size_t((*tree)[0].visits) >= limit.nodes || !select(state, path)) return undo(path);
+				leaf = !(*tree)[path.back().first].terminal;
+			}
+			float v = leaf ? evaluate(state, estimate, engine) : -1;
+			std::lock_guard<std::mutex> lock(mutex);
+			backup(path, v);
+		}
+	}
+
+	/**
+	 * descend from the root to a node visited for the first time, and expand
+	 * it; every node on the path takes a virtual loss
+	 * return false if the arena cannot hold the expansion
+	 */
+	bool select(board& state, std::vector<std::pair<int, float>>& path) {
+		std::vector<node>& arena = *tree;
+		state = root;
+		int at = 0;
+		path.emplace_back(0, 0);
+		arena[0].visits++;
+		while (arena[at].first >= 0 && !arena[at].terminal) {
+			const node& parent = arena[at];
+			bool env = (state.type == 'a');
+			float range = (hi > lo) ? (hi - lo) : 1;
+			float ln = std::log(float(parent.visits));
+			int pick = -1;
+			float top = 0;
+			for (int c = parent.first; c < parent.first + parent.count; c++) {
+				const node& n = arena[c];
+				if (n.visits == 0) { pick = c; break; }
+				float q = (n.sum / n.visits - lo) / range;
+				float score = (env ? 1 - q : q) + limit.explore * std::sqrt(ln / n.visits);
+				if (pick == -1 || score > top) pick = c, top = score;
+			}
+			at = pick;
+			node& n = arena[at];
+			if (env) {
+				if (state.bag[0] == 0 && state.bag[1] == 0 && state.bag[2] == 0) state.bag = {{ 4, 4, 4 }};
+				state.place(n.move, state.hint);
+				state.hint = n.hint;
+				if (n.hint < 4) --state.bag[n.hint - 1];
+				state.type = 'b';
+			} else {
+				state.slide(n.move);
+				state.type = 'a';
+			}
+			float loss = seen ? (env ? hi : lo) : 0;
+			n.visits++;
+			n.sum += loss;
+			path.emplace_back(at, loss);
+		}
+		return expand(state, at);
+	}
+
+	bool expand(board& state, int at) {
+		std::vector<node>& arena = *tree;
+		if (arena[at].first >= 0) return true;
+		node child;
+		std::vector<node> children;
+		if (state.type == 'a') {
+			if (state.bag[0] == 0 && state.bag[1] == 0 && state.bag[2] == 0) state.bag = {{ 4, 4, 4 }};
+			for (unsigned m = state.placeable(); m; m &= m - 1) {
+				child.move = __builtin_ctz(m);
+				for (int i = 0; i < 3; i++) {
+					if (state.bag[i] == 0) continue;
+					child.hint = i + 1;
+					children.push_back(child);
+				}
+				for (int i = 4; bonus && state.max > 6 && i <= state.max - 3; i++) {
+					child.hint = i;
+					children.push_back(child);
+				}
+			}
+		} else {
+			for (unsigned m = state.movable(); m; m &= m - 1) {
+				board after = state;
+				child.move = __builtin_ctz(m);
+				child.reward = after.slide(child.move);
+				children.push_back(child);
+			}
+		}
+		if (arena.size() + children.size() > limit.nodes) return false;
+		arena[at].first = arena.size();
+		arena[at].count = children.size();
+		arena[at].terminal = children.empty();
+		arena.insert(arena.end(), children.begin(), children.end());
+		return true;
+	}
+
+	/**
+	 * the value of a newly expanded state for the player
+	 */
+	template<typename value>
+	float evaluate(board state, value& estimate, rng& engine) {
+		float sum = 0;
+		for (int ply = 0; ply < limit.rollout; ply++) {
+			if (state.type == 'a') {
+				if (state.bag[0] == 0 && state.bag[1] == 0 && state.bag[2] == 0) state.bag = {{ 4, 4, 4 }};
+				unsigned cells = state.placeable();
+				if (cells == 0) break;
+				int pos = 0;
+				for (int k = engine.below(__builtin_popcount(cells)); k >= 0; k--, cells &= cells - 1) pos = __builtin_ctz(cells);
+				state.place(pos, state.hint);
+				int i;
+				do i = engine.below(3); while (state.bag[i] == 0);
+				state.hint = i + 1;
+				--state.bag[i];
+				state.type = 'b';
+			} else {
+				unsigned moves = state.movable();
+				if (moves == 0) return sum - 1;
+				int op = 0;
+				for (int k = engine.below(__builtin_popcount(moves)); k >= 0; k--, moves &= moves - 1) op = __builtin_ctz(moves);
+				sum += state.slide(op);
+				state.type = 'a';
+			}
+		}
+		if (state.type == 'a') return sum + estimate(state);
+		float best = -1;
+		bool found = false;
+		for (unsigned m = state.movable(); m; m &= m - 1) {
+			board after = state;
+			float v = after.slide(__builtin_ctz(m));
+			after.type = 'a';
+			v += estimate(after);
+			if (!found || v > best) best = v;
+			found = true;
+		}
+		return sum + best;
+	}
+
+	void undo(const std::vector<std::pair<int, float>>& path) {
+		std::vector<node>& arena = *tree;
+		for (const std::pair<int, float>& at : path) {
+			arena[at.first].visits--;
+			arena[at.first].sum -= at.second;
+		}
+	}
+
+	/**
+	 * add the return of the leaf to every node on the path, replacing the
+	 * virtual losses taken by select
+	 */
+	void backup(const std::vector<std::pair<int, float>>& path, float v) {
+		std::vector<node>& arena = *tree;
+		for (size_t k = path.size(); k-- > 1; ) {
+			node& n = arena[path[k].first];
+			v += n.reward;
+			n.sum += v - path[k].second;
+			if (!seen || v < lo) lo = v;
+			if (!seen || v > hi) hi = v;
+			seen = true;
+		}
+	}
+
+private:
+	budget limit;
+	board root;
+	bool bonus = false;
+	float lo = 0, hi = 0; // the range of returns seen, for normalizing
+	bool seen = false;
+	std::chrono::steady_clock::time_point deadline;
+	const std::atomic<bool>* stop = nullptr;
+	std::vector<node>* tree = nullptr;
+	std::mutex mutex;
+};
@@ -0,0 +1,207 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <array>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * machine readable metrics stream, enabled by --metrics=path
+ *
+ * the game loop only feeds O(1) aggregates (a latency histogram per agent,
+ * counters, and the scores of the window); a record is written once per
+ * 'block' episodes, or every 'period' seconds if period > 0, covering the
+ * episodes since the previous record
+ *
+ * the path may be a regular file or a FIFO; records are CSV with a header
+ * line if the path ends with ".csv", otherwise one JSON object per line:
+ * {"episodes":1000,"elapsed":12.5,"eps_per_sec":80.0,
+ *  "moves_per_sec":{"play":..,"evil":..},
+ *  "latency_us":{"play":{"mean":..,"p50":..,"p90":..,"p99":..,"max":..},"evil":{..}},
+ *  "score":{"mean":..,"p50":..,"max":..},"max_tile":{"24":3,"48":..},
+ *  "updates_per_sec":..,"weight_bytes":..,"weight_resident":..,"rss":..}
+ *  'episodes': the episodes finished so far
+ *  'elapsed': the seconds covered by this record
+ *  'moves_per_sec': moves of the agent per second of its own decision time
+ *  'latency_us': the decision time of one move, the percentiles are within
+ *                1/8 of the true value (log-linear histogram)
+ *  'max_tile': the number of episodes ending with each max tile
+ *  'updates_per_sec': afterstates updated by training per second
+ *  'weight_bytes', 'weight_resident': the weight store, and the part of it
+ *                                     resident in memory
+ *  'rss': the resident set of the process
+ */
+class metrics {
+public:
+	enum who { play, evil, agents };
+
+	metrics(const std::string& path = "", size_t block = 0, double period = 0)
+		: block(block ? block : 1), period(period), csv(false), last(0) {
+		clear();
+		if (path.empty()) return;
+		csv = path.size() > 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+		struct stat info;
+		bool fresh = stat(path.c_str(), &info) != 0 || S_ISFIFO(info.st_mode) || info.st_size == 0;
+		out.open(path, std::ios::out | std::ios::app); // blocks until a reader opens a FIFO
+		if (!out.is_open()) {
+			std::cerr << "metrics: cannot open " << path << std::endl;
+			return;
+		}
+		if (csv && fresh) out << header() << std::endl;
+	}
+
+	bool enabled() const { return out.is_open(); }
+
+	/**
+	 * the decision time of one move of an agent
+	 */
+	void move(who w, uint64_t ns) {
+		latency& l = lat[w];
+		l.bins[bin(ns)]++;
+		l.calls++;
+		l.ns += ns;
+		l.max = std::max(l.max, ns);
+	}
+
+	void episode(int score, int tile) {
+		scores.push_back(score);
+		tiles[tile & 15]++;
+	}
+
+	/**
+	 * write a record if one is due; 'count' is the episodes finished so far,
+	 * 'updates' the training updates so far, and the weight store is queried
+	 * only when writing
+	 */
+	template<typename store>
+	void flush(size_t count, size_t updates, const store& weights, bool final = false) {
+		if (!enabled() || scores.empty()) return;
+		double elapsed = std::chrono::duration<double>(clock::now() - since).count();
+		if (!final && (period > 0 ? elapsed < period : count % block != 0)) return;
+		elapsed = std::max(elapsed, 1e-9);
+		std::vector<int> sorted(scores);
+		std::sort(sorted.begin(), sorted.end());
+		double mean = 0;
+		for (int s : sorted) mean += s;
+		mean /= sorted.size();
+		double ups = (updates - last) / elapsed;
+		size_t bytes = weights.footprint(), resident = weights.footprint(true);
+
+		std::ostringstream line;
+		line << std::fixed << std::setprecision(2);
+		if (csv) {
+			line << count << ',' << elapsed << ',' << (scores.size() / elapsed);
+			for (int w = 0; w < agents; w++) line << ',' << lat[w].rate();
+			for (int w = 0; w < agents; w++) {
+				line << ',' << lat[w].mean() << ',' << lat[w].percentile(0.5)
+					<< ',' << lat[w].percentile(0.9) << ',' << lat[w].percentile(0.99) << ',' << (lat[w].max / 1000.0);
+			}
+			line << ',' << mean << ',' << sorted[sorted.size() / 2] << ',' << sorted.back();
+			for (int t = 1; t < 16; t++) line << ',' << tiles[t];
+			line << ',' << ups << ',' << bytes << ',' << resident << ',' << rss();
+		} else {
+			const char* name[] = { "play", "evil" };
+			line << "{\"episodes\":" << count << ",\"elapsed\":" << elapsed << ",\"eps_per_sec\":" << (scores.size() / elapsed);
+			line << ",\"moves_per_sec\":{";
+			for (int w = 0; w < agents; w++) line << (w ? "," : "") << '"' << name[w] << "\":" << lat[w].rate();
+			line << "},\"latency_us\":{";
+			for (int w = 0; w < agents; w++) {
+				line << (w ? "," : "") << '"' << name[w] << "\":{\"mean\":" << lat[w].mean()
+					<< ",\"p50\":" << lat[w].percentile(0.5) << ",\"p90\":" << lat[w].percentile(0.9)
+					<< ",\"p99\":" << lat[w].percentile(0.99) << ",\"max\":" << (lat[w].max / 1000.0) << '}';
+			}
+			line << "},\"score\":{\"mean\":" << mean << ",\"p50\":" << sorted[sorted.size() / 2] << ",\"max\":" << sorted.back();
+			line << "},\"max_tile\":{";
+			for (int t = 1, first = 1; t < 16; t++) {
+				if (tiles[t] == 0) continue;
+				line << (first ? "" : ",") << '"' << value(t) << "\":" << tiles[t];
+				first = 0;
+			}
+			line << "},\"updates_per_sec\":" << ups << ",\"weight_bytes\":" << bytes
+				<< ",\"weight_resident\":" << resident << ",\"rss\":" << rss() << '}';
+		}
+		out << line.str() << std::endl;
+		last = updates;
+		clear();
+	}
+
+private:
+	typedef std::chrono::steady_clock clock;
+
+	/**
+	 * log-linear latency histogram: 8 bins per power of two of nanoseconds
+	 */
+	struct latency {
+		std::array<uint64_t, 64 * 8> bins;
+		uint64_t calls, ns, max;
+		double mean() const { return calls ? ns / 1000.0 / calls : 0; }
+		double rate() const { return ns ? calls * 1e9 / ns : 0; }
+		double percentile(double p) const {
+			uint64_t rank = uint64_t(p * calls), seen = 0;
+			for (size_t i = 0; i < bins.size(); i++) {
+				seen += bins[i];
+				if (calls && seen > rank) return lower(i) / 1000.0;
+			}
+			return max / 1000.0;
+		}
+	};
+
+	static size_t bin(uint64_t ns) {
+		if (ns < 8) return ns;
+		int e = 63 - __builtin_clzll(ns);
+		return (e - 2) * 8 + ((ns >> (e - 3)) & 7);
+	}
+	static double lower(size_t i) {
+		if (i < 8) return i;
+		int e = i / 8 + 2;
+		return double((8 + i % 8) * (1ull << (e - 3)));
+	}
+
+	static int value(int t) { return (t > 3) ? (1 << (t - 3)) * 3 : t; }
+
+	static size_t rss() {
+		std::ifstream statm("/proc/self/statm");
+		size_t pages = 0, resident = 0;
+		statm >> pages >> resident;
+		return resident * sysconf(_SC_PAGESIZE);
+	}
+
+	static std::string header() {
+		std::ostringstream h;
+		h << "episodes,elapsed,eps_per_sec,play_moves_per_sec,evil_moves_per_sec";
+		for (const char* name : { "play", "evil" }) {
+			h << ',' << name << "_mean_us," << name << "_p50_us," << name << "_p90_us,"
+				<< name << "_p99_us," << name << "_max_us";
+		}
+		h << ",score_mean,score_p50,score_max";
+		for (int t = 1; t < 16; t++) h << ",tile_" << value(t);
+		h << ",updates_per_sec,weight_bytes,weight_resident,rss";
+		return h.str();
+	}
+
+	void clear() {
+		for (latency& l : lat) {
+			l.bins.fill(0);
+			l.calls = l.ns = l.max = 0;
+		}
+		tiles.fill(0);
+		scores.clear();
+		since = clock::now();
+	}
+
+private:
+	std::ofstream out;
+	size_t block;
+	double period;
+	bool csv;
+	size_t last;
+	clock::time_point since;
+	std::array<latency, agents> lat;
+	std::array<size_t, 16> tiles;
+	std::vector<int> scores;
+};
@@ -0,0 +1,59 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <sys/mman.h>
+#include "weight.h"
+
+/**
+ * 16-bit copy of the weight tables for the leaf evaluations of the searches
+ * (eval=quantized)
+ *
+ * entry i of table t is round(w[i] / scale(t)), where scale(t) is the largest
+ * |w| of the table over 32767, so the copy takes half the memory and a cache
+ * line holds twice the entries; a sum of 32 entries is off by at most
+ * error() from the sum of the float entries (8 bits would round most of the
+ * entries of a trained network, which are far below its largest, to zero)
+ *
+ * the copy is anonymous memory where only the non-zero entries are written,
+ * so the pages of a table never touched stay unallocated; it is made once,
+ * so it is meant for networks that are no longer trained
+ */
+class quantized {
+public:
+	quantized(const std::vector<weight>& net) : scales(net.size(), 0), slack(0) {
+		for (const weight& w : net) {
+			table.push_back(allocate(w.size()));
+			length.push_back(w.size());
+			float& s = scales[table.size() - 1];
+			const uint32_t* bits = reinterpret_cast<const uint32_t*>(w.data());
+			for (size_t i = 0; i < w.size(); i++) if (bits[i]) s = std::max(s, std::abs(w[i]));
+			s = (s > 0) ? s / 32767 : 1;
+			for (size_t i = 0; i < w.size(); i++) if (bits[i]) table.back()[i] = int16_t(std::lround(w[i] / s));
+			slack = std::max(slack, 16 * s);
+		}
+	}
+	~quantized() {
+		for (size_t t = 0; t < table.size(); t++) munmap(table[t], sizeof(int16_t) * length[t]);
+	}
+	quantized(const quantized&) = delete;
+	quantized& operator =(const quantized&) = delete;
+
+	const int16_t* data(size_t t) const { return table[t]; }
+	float scale(size_t t) const { return scales[t]; }
+	float error() const { return slack; }
+
+private:
+	static int16_t* allocate(size_t len) {
+		void* ptr = mmap(nullptr, sizeof(int16_t) * len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ptr == MAP_FAILED) throw std::bad_alloc();
+		return static_cast<int16_t*>(ptr);
+	}
+
+private:
+	std::vector<int16_t*> table;
+	std::vector<size_t> length;
+	std::vector<float> scales;
+	float slack;
+};
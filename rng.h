@@ -0,0 +1,55 @@
+#pragma once
+#include <cstdint>
+
+/**
+ * xoshiro256** pseudo random generator
+ *
+ * satisfies UniformRandomBitGenerator, so it works with std::shuffle and the
+ * <random> distributions; the state is seeded with splitmix64 from a seed and
+ * a stream index, so every (seed, stream) pair, e.g. one per agent and worker
+ * thread, yields an independent and reproducible sequence
+ */
+class rng {
+public:
+	typedef uint64_t result_type;
+
+	rng(uint64_t seed = 0, uint64_t stream = 0) { this->seed(seed, stream); }
+
+	void seed(uint64_t seed, uint64_t stream = 0) {
+		uint64_t x = seed ^ (stream * 0xd1342543de82ef95ull);
+		for (uint64_t& v : s) v = splitmix(x);
+	}
+
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return ~0ull; }
+
+	result_type operator()() {
+		uint64_t result = rotl(s[1] * 5, 7) * 9;
+		uint64_t t = s[1] << 17;
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = rotl(s[3], 45);
+		return result;
+	}
+
+	/**
+	 * uniform integer in [0, n) by multiply-shift (Lemire), n > 0
+	 */
+	uint32_t below(uint32_t n) {
+		return uint32_t(((operator()() >> 32) * n) >> 32);
+	}
+
+private:
+	static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+	static uint64_t splitmix(uint64_t& x) {
+		uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		return z ^ (z >> 31);
+	}
+
+	uint64_t s[4];
+};
@@ -0,0 +1,180 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <iostream>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * named POSIX shared memory segment holding the weight tables
+ *
+ * lets independent processes (shm=name) train into, or evaluate from, the
+ * same tables without locks (Hogwild); the segment is a header page followed
+ * by the tables, each aligned to a page:
+ *  - the coordinator (coordinator=1) creates the segment with its layout,
+ *    initializes and loads the tables, then marks it ready; it is also the
+ *    only process that saves the tables
+ *  - the other processes wait until the segment is ready, and refuse a
+ *    layout (version, tables, lengths, order of the entries) different from
+ *    their own
+ *  - every process counts itself in the header while attached, and the last
+ *    one to detach removes the name
+ *
+ * a segment outlives processes that crash, so a coordinator finding the
+ * name refuses it while the coordinator recorded in its header runs, and
+ * otherwise unlinks it as stale and creates a fresh one (processes still
+ * attached to the stale one keep it until they detach, and never remove the
+ * fresh name); the other processes only attach to a segment whose
+ * coordinator runs (the pids are checked in the pid namespace of the caller)
+ */
+class segment {
+public:
+	static constexpr uint32_t magic = 0x4d535054; // "TPSM"
+	static constexpr uint32_t version = 2;
+
+	segment(const std::string& name, const std::vector<size_t>& length, int order, bool coordinator)
+			: name(name[0] == '/' ? name : "/" + name), base(nullptr), bytes(0), order(order), layout(length.size()) {
+		if (length.size() > sizeof(head->length) / sizeof(head->length[0])) fail("too many tables");
+		bytes = page;
+		for (size_t t = 0; t < length.size(); t++) {
+			layout[t] = bytes;
+			bytes += (length[t] * sizeof(float) + page - 1) / page * page;
+		}
+		if (coordinator) create(length);
+		else attach(length);
+	}
+	~segment() {
+		if (!base) return;
+		if (--head->attached == 0 && named()) shm_unlink(name.c_str());
+		munmap(base, bytes);
+	}
+
+	float* table(size_t t) const { return reinterpret_cast<float*>(static_cast<char*>(base) + layout[t]); }
+
+	/**
+	 * let the other processes in, once the coordinator has loaded the tables
+	 */
+	void publish() { head->state.store(ready, std::memory_order_release); }
+
+private:
+	enum { initializing = 0, ready = 1 };
+	struct header {
+		uint32_t magic;
+		uint32_t version;
+		std::atomic<uint32_t> state;
+		std::atomic<uint32_t> attached;
+		uint32_t tables;
+		uint32_t order; // the order of the entries (weight_agent::arrange)
+		int32_t coordinator; // the pid of the coordinator
+		uint64_t length[32]; // the entries of every table
+	};
+	static constexpr size_t page = 4096;
+
+	void create(const std::vector<size_t>& length) {
+		int fd = shm_open(name.c_str(), O_RDWR, 0644);
+		if (fd >= 0) {
+			int32_t pid = coordinator_of(fd);
+			close(fd);
+			if (alive(pid)) fail("in use by a running coordinator");
+			std::cerr << "shm: removing the stale segment " << name << std::endl;
+			shm_unlink(name.c_str());
+		}
+		fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+		if (fd < 0 || ftruncate(fd, bytes) != 0) fail("cannot create");
+		map(fd);
+		head->magic = magic;
+		head->version = version;
+		head->tables = length.size();
+		head->order = order;
+		head->coordinator = getpid();
+		for (size_t t = 0; t < length.size(); t++) head->length[t] = length[t];
+		head->attached.store(1);
+		head->state.store(initializing);
+	}
+
+	void attach(const std::vector<size_t>& length) {
+		for (bool told = false; ; told = true) {
+			int fd = shm_open(name.c_str(), O_RDWR, 0644);
+			struct stat info;
+			if (fd >= 0 && fstat(fd, &info) == 0 && size_t(info.st_size) >= page) {
+				void* at = mmap(nullptr, page, PROT_READ, MAP_SHARED, fd, 0);
+				header* h = static_cast<header*>(at);
+				if (at != MAP_FAILED && h->magic == magic && h->state.load(std::memory_order_acquire) == ready && alive(h->coordinator)) {
+					bool same = h->version == version && h->tables == length.size() && h->order == uint32_t(order);
+					for (size_t t = 0; same && t < length.size(); t++) same = h->length[t] == length[t];
+					munmap(at, page);
+					if (!same) fail("the layout differs from the coordinator's (e.g. stage= or layout=)");
+					map(fd);
+					head->attached++;
+					return;
+				}
+				if (at != MAP_FAILED) munmap(at, page);
+			}
+			if (fd >= 0) close(fd);
+			if (!told) std::cerr << "shm: waiting for the coordinator of " << name << std::endl;
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+
+	void map(int fd) {
+		struct stat info;
+		if (fstat(fd, &info) == 0) inode = info.st_ino;
+		base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (base == MAP_FAILED) base = nullptr, fail("cannot map");
+		head = static_cast<header*>(base);
+	}
+
+	/**
+	 * the pid of the coordinator recorded by the segment open as 'fd', or 0
+	 */
+	static int32_t coordinator_of(int fd) {
+		struct stat info;
+		if (fstat(fd, &info) != 0 || size_t(info.st_size) < page) return 0;
+		void* at = mmap(nullptr, page, PROT_READ, MAP_SHARED, fd, 0);
+		if (at == MAP_FAILED) return 0;
+		const header* h = static_cast<const header*>(at);
+		int32_t pid = (h->magic == magic) ? h->coordinator : 0;
+		munmap(at, page);
+		return pid;
+	}
+	static bool alive(int32_t pid) {
+		return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+	}
+
+	/**
+	 * whether the name still refers to this segment, not to a fresh one
+	 * created after this one was found stale
+	 */
+	bool named() const {
+		int fd = shm_open(name.c_str(), O_RDONLY, 0644);
+		if (fd < 0) return false;
+		struct stat info;
+		bool same = fstat(fd, &info) == 0 && info.st_ino == inode;
+		close(fd);
+		return same;
+	}
+
+	void fail(const char* why) const {
+		std::cerr << "shm: " << name << ": " << why << std::endl;
+		std::exit(-1);
+	}
+
+private:
+	std::string name;
+	void* base;
+	header* head = nullptr;
+	ino_t inode = 0;
+	size_t bytes;
+	int order;
+	std::vector<size_t> layout; // the offset of every table
+};
@@ -0,0 +1,158 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <thread>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "board.h"
+#include "action.h"
+#include "agent.h"
+#include "topology.h"
+
+/**
+ * persistent evaluation server around a player with loaded weights
+ *
+ * the protocol is line based; a batch is a run of query lines terminated by
+ * an empty line (or the end of input), and is answered with one line per
+ * query followed by an empty line
+ *
+ * query:  <tiles> <hint> <last> [<bag1> <bag2> <bag3>]
+ *         e.g. "0000010020003000 2 L 4 3 4"
+ *  '<tiles>': 16 base-36 tile indices in 1-d order (as in action::place)
+ *  '<hint>': the next tile, 1-3 or 4 for a bonus tile
+ *  '<last>': the last slide, one of URDL, or '-' for none
+ *  '<bag>': the remaining basic tiles, {4, 4, 4} if omitted
+ *
+ * answer: <value> <action>
+ *         e.g. "1523.25 #U", or "-1 ??" if no slide is legal (or the query is malformed)
+ *  '<value>': the best reward plus afterstate value found by player::decide
+ *  '<action>': the best slide
+ *
+ * queries of a batch are split across the worker threads
+ */
+class server {
+public:
+	server(player& play, size_t threads = 0) : play(play),
+		threads(threads ? threads : std::max(1u, std::thread::hardware_concurrency())) {}
+
+	/**
+	 * serve on stdin/stdout if path is empty or "-", otherwise listen on a
+	 * unix domain socket and serve each connection on its own thread
+	 */
+	void serve(const std::string& path) {
+		if (path.empty() || path == "-") {
+			session(0, 1);
+			return;
+		}
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		sockaddr_un addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+		unlink(path.c_str());
+		if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+			std::cerr << "serve: cannot listen on " << path << std::endl;
+			std::exit(-1);
+		}
+		for (int conn; (conn = accept(fd, nullptr, nullptr)) >= 0; ) {
+			std::thread([this, conn]() { session(conn, conn); close(conn); }).detach();
+		}
+		close(fd);
+	}
+
+	/**
+	 * answer a batch of queries in place, split across the worker threads
+	 */
+	void evaluate(std::vector<std::string>& batch) {
+		size_t n = std::min(threads, batch.size());
+		if (n <= 1) {
+			for (std::string& line : batch) line = answer(line);
+			return;
+		}
+		std::vector<std::thread> workers;
+		for (size_t t = 0; t < n; t++) {
+			workers.emplace_back([this, &batch, t, n]() {
+				if (topology::nodes() > 1) topology::bind(int(t));
+				for (size_t i = t; i < batch.size(); i += n) batch[i] = answer(batch[i]);
+			});
+		}
+		for (std::thread& worker : workers) worker.join();
+	}
+
+	std::string answer(const std::string& query) const {
+		board state;
+		if (!parse(query, state)) return "-1 ??";
+		float value;
+		int op = play.decide(state, value);
+		std::stringstream out;
+		if (op == -1) out << "-1 ??";
+		else out << std::fixed << std::setprecision(2) << value << ' ' << action::slide(op);
+		return out.str();
+	}
+
+	static bool parse(const std::string& query, board& state) {
+		const char* idx = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+		const char* opc = "URDL";
+		std::stringstream in(query);
+		std::string tiles, last;
+		int hint = 0;
+		if (!(in >> tiles >> hint >> last) || tiles.size() != 16) return false;
+		if (hint < 1 || hint > 4 || last.size() != 1) return false;
+		for (unsigned pos = 0; pos < 16; pos++) {
+			unsigned tile = std::find(idx, idx + 36, std::toupper(tiles[pos])) - idx;
+			if (tile >= 16) return false;
+			state(pos) = tile;
+			state.max = std::max(state.max, int(tile));
+		}
+		state.hint = hint;
+		state.last = (last[0] == '-') ? -1 : int(std::find(opc, opc + 4, last[0]) - opc);
+		if (state.last == 4) return false;
+		state.bag = {{ 4, 4, 4 }};
+		in >> state.bag[0] >> state.bag[1] >> state.bag[2];
+		return true;
+	}
+
+private:
+	void session(int in, int out) {
+		std::vector<std::string> batch;
+		std::string buffer;
+		char chunk[65536];
+		for (ssize_t len; (len = read(in, chunk, sizeof(chunk))) > 0; ) {
+			buffer.append(chunk, len);
+			size_t from = 0;
+			for (size_t eol; (eol = buffer.find('\n', from)) != std::string::npos; from = eol + 1) {
+				std::string line = buffer.substr(from, eol - from);
+				if (line.size() && line.back() == '\r') line.pop_back();
+				if (line.size()) batch.push_back(line);
+				else if (!reply(out, batch)) return;
+			}
+			buffer.erase(0, from);
+		}
+		if (buffer.size()) batch.push_back(buffer);
+		reply(out, batch);
+	}
+
+	bool reply(int out, std::vector<std::string>& batch) {
+		if (batch.empty()) return true;
+		evaluate(batch);
+		std::string text;
+		for (const std::string& line : batch) text += line + '\n';
+		text += '\n';
+		batch.clear();
+		for (size_t sent = 0; sent < text.size(); ) {
+			ssize_t len = write(out, text.data() + sent, text.size() - sent);
+			if (len <= 0) return false;
+			sent += len;
+		}
+		return true;
+	}
+
+private:
+	player& play;
+	size_t threads;
+};
@@ -7,6 +7,7 @@
 #include "action.h"
 #include "agent.h"
 #include "episode.h"
+#include "profiler.h"
 
 class statistic {
 public:
@@ -45,6 +46,8 @@ public:
 	 *                                  the average speed of environment is 896715
 	 *  '93.7%': 93.7% (937 games) reached 8192-tiles (a.k.a. win rate of 8192-tile)
 	 *  '22.4%': 22.4% (224 games) terminated with 8192-tiles (the largest)
+	 *
+	 * with --profile, the timed regions of profiler follow the 'ops =' line
 	 */
 	void show(bool tstat = true) const {
 		size_t blk = std::min(data.size(), block);
@@ -77,6 +80,7 @@ public:
 		std::cout <<      "|" << (eop * 1000.0 / edu) << ")";
 		std::cout << std::endl;
 		std::cout.copyfmt(ff);
+		profiler::report(std::cout);
 
 		if (!tstat) return;
 		for (size_t t = 0, c = 0; c < blk; c += stat[t++]) {
@@ -96,6 +100,20 @@ public:
 		const_cast<statistic&>(*this).block = data.size();
 		show();
 		const_cast<statistic&>(*this).block = block_temp;
+		if (goal > 0 && reached == 0) std::cout << "target " << goal << " not reached in " << count << " episodes" << std::endl << std::endl;
+	}
+
+	/**
+	 * set a target average score: the first block whose average reaches it
+	 * is reported as 'target 3000 reached after 12000 episodes', which is how
+	 * the learning rules (e.g. lambda=, tc=) of the player are compared
+	 */
+	void target(double score) {
+		goal = score;
+	}
+
+	size_t episodes() const {
+		return count;
 	}
 
 	bool is_finished() const {
@@ -103,14 +121,19 @@ public:
 	}
 
 	void open_episode(const std::string& flag = "") {
-		if (count++ >= limit) data.pop_front();
+		if (count++, data.size() >= limit) data.pop_front();
 		data.emplace_back();
 		data.back().open_episode(flag);
 	}
 
 	void close_episode(const std::string& flag = "") {
 		data.back().close_episode(flag);
-		if (count % block == 0) show();
+		if (count % block) return;
+		show();
+		if (goal > 0 && reached == 0 && average() >= goal) {
+			reached = count;
+			std::cout << "target " << goal << " reached after " << reached << " episodes" << std::endl << std::endl;
+		}
 	}
 
 	episode& at(size_t i) {
@@ -125,24 +148,49 @@ public:
 		return data.back();
 	}
 
+	/**
+	 * the records are one episode per line; if the 'limit' dropped older
+	 * episodes, a leading '#count=N' line keeps the real episode count so
+	 * that a run resumed from a checkpoint continues from the right index
+	 */
 	friend std::ostream& operator <<(std::ostream& out, const statistic& stat) {
+		if (stat.count > stat.data.size()) out << "#count=" << stat.count << std::endl;
 		for (const episode& rec : stat.data) out << rec << std::endl;
 		return out;
 	}
 	friend std::istream& operator >>(std::istream& in, statistic& stat) {
+		size_t count = 0;
 		for (std::string line; std::getline(in, line) && line.size(); ) {
+			if (line.find("#count=") == 0) {
+				count = std::stoull(line.substr(line.find('=') + 1));
+				continue;
+			}
 			stat.data.emplace_back();
 			std::stringstream(line) >> stat.data.back();
 		}
-		stat.total = std::max(stat.total, stat.data.size());
-		stat.count = stat.data.size();
+		stat.count = std::max(count, stat.data.size());
+		stat.total = std::max(stat.total, stat.count);
 		return in;
 	}
 
+private:
+	/**
+	 * the average score of the last 'block' episodes
+	 */
+	double average() const {
+		size_t blk = std::min(data.size(), block);
+		double sum = 0;
+		auto it = data.end();
+		for (size_t i = 0; i < blk; i++) sum += (--it)->score();
+		return blk ? sum / blk : 0;
+	}
+
 private:
 	size_t total;
 	size_t block;
 	size_t limit;
 	size_t count;
+	double goal = 0;
+	size_t reached = 0;
 	std::list<episode> data;
 };
@@ -0,0 +1,16 @@
+#!/bin/sh
+# a tournament of a weight file against itself must give a difference of
+# exactly zero at any thread count, as the games of the candidates are paired
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+./main --total=20 --block=20 --play="seed=1 save=$dir/a.bin format=sparse" --evil="seed=1" > /dev/null
+for threads in 1 2 3; do
+	out=$(./main --tournament=$dir/a.bin,$dir/a.bin --total=40 --block=40 --threads=$threads --evil="depth=1" 2>&1)
+	if ! echo "$out" | grep -q "diff = +0 +- 0"; then
+		echo "paired: a self-tournament with --threads=$threads is not paired"
+		echo "$out"
+		exit 1
+	fi
+done
+echo "paired: ok"
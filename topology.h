@@ -0,0 +1,103 @@
+#pragma once
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sched.h>
+
+/**
+ * numa topology helper for replicated weight tables
+ *
+ * nodes are read from /sys/devices/system/node; a machine without that
+ * directory is treated as a single node owning every cpu
+ * each thread remembers the node it has been bound to, which selects the
+ * replica used by weight_agent::tables()
+ */
+class topology {
+public:
+	/**
+	 * number of online numa nodes (at least 1)
+	 */
+	static int nodes() {
+		return int(cpulists().size());
+	}
+
+	/**
+	 * the node the calling thread has been bound to (0 if never bound)
+	 */
+	static int current() {
+		return bound();
+	}
+
+	/**
+	 * the node owning a specific cpu, or 0 if unknown
+	 */
+	static int node_of(int cpu) {
+		auto& list = cpulists();
+		for (size_t n = 0; n < list.size(); n++) {
+			if (std::find(list[n].begin(), list[n].end(), cpu) != list[n].end()) return int(n);
+		}
+		return 0;
+	}
+
+	/**
+	 * pin the calling thread to the cpus of a node and remember the node
+	 * worker threads are distributed round-robin by passing their index
+	 */
+	static void bind(int node) {
+		auto& list = cpulists();
+		node %= int(list.size());
+		bound() = node;
+		if (list[node].empty()) return;
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int cpu : list[node]) CPU_SET(cpu, &set);
+		sched_setaffinity(0, sizeof(set), &set);
+	}
+
+	/**
+	 * bind the calling thread to the node it is currently running on
+	 */
+	static void bind_local() {
+		int cpu = sched_getcpu();
+		bind(cpu < 0 ? 0 : node_of(cpu));
+	}
+
+private:
+	static int& bound() {
+		static thread_local int node = 0;
+		return node;
+	}
+
+	static std::vector<std::vector<int>>& cpulists() {
+		static std::vector<std::vector<int>> list = discover();
+		return list;
+	}
+
+	static std::vector<std::vector<int>> discover() {
+		std::vector<std::vector<int>> list;
+		for (int n = 0; ; n++) {
+			std::ifstream in("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist");
+			if (!in.is_open()) break;
+			std::string text;
+			std::getline(in, text);
+			list.push_back(parse(text));
+		}
+		if (list.empty()) list.emplace_back();
+		return list;
+	}
+
+	static std::vector<int> parse(const std::string& text) { // e.g. "0-3,8-11"
+		std::vector<int> cpus;
+		std::stringstream ss(text);
+		for (std::string range; std::getline(ss, range, ','); ) {
+			if (range.empty()) continue;
+			size_t dash = range.find('-');
+			int lo = std::stoi(range.substr(0, dash));
+			int hi = (dash == std::string::npos) ? lo : std::stoi(range.substr(dash + 1));
+			for (int cpu = lo; cpu <= hi; cpu++) cpus.push_back(cpu);
+		}
+		return cpus;
+	}
+};
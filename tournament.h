@@ -0,0 +1,186 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cmath>
+#include <numeric>
+#include <iostream>
+#include <iomanip>
+#include "board.h"
+#include "action.h"
+#include "agent.h"
+#include "episode.h"
+#include "topology.h"
+
+/**
+ * evaluation tournament between weight files
+ *
+ * every candidate is a player loaded once (alpha=0) and shared read-only by
+ * the worker threads; each thread has its own environment, which reads the
+ * tables of one environment made (and loaded) once, and plays game g
+ * for all candidates in turn, reseeding the environment with g each time,
+ * so that the candidates meet the same initial tiles and the same random
+ * choices of the environment (paired games)
+ *
+ * every 'block' games, a line per candidate shows the mean score with its
+ * 95% confidence interval, and each later candidate is compared with the
+ * first by the paired differences of scores:
+ * 200	a.bin	avg = 1532 +- 48, max = 4413
+ * 	b.bin	avg = 1611 +- 51, max = 4890, diff = +79 +- 22 (better)
+ * a comparison is decided once the interval of the difference at z = 3
+ * (to allow for the repeated looks) excludes zero, and the tournament stops
+ * early when all comparisons are decided; the tile rates of each candidate
+ * are shown at the end in the format of statistic::show
+ *
+ * the bonus tile ratio of the search (depth=, ms=) is not tracked per game,
+ * as the shared players are not written during a tournament
+ */
+class tournament {
+public:
+	tournament(const std::vector<std::string>& weights, const std::string& play_args, const std::string& evil_args,
+			size_t total, size_t block, size_t threads) : names(weights), evil_args(evil_args), total(total),
+			block(block ? block : std::max<size_t>(total / 10, 1)),
+			threads(threads ? threads : std::max(1u, std::thread::hardware_concurrency())) {
+		environment.reset(new rndenv(evil_args));
+		for (const std::string& path : weights) {
+			candidates.emplace_back(new player(play_args + " load=" + path + " alpha=0"));
+		}
+		score.assign(weights.size(), std::vector<int>(total, 0));
+		tile.assign(weights.size(), std::vector<int>(total, 0));
+		done.assign(total, false);
+	}
+
+	void run() {
+		std::atomic<size_t> next(0);
+		std::vector<std::thread> workers;
+		for (size_t t = 0; t < threads; t++) {
+			workers.emplace_back([this, &next, t]() {
+				if (topology::nodes() > 1) topology::bind(int(t)); // round-robin, to read the replicas of numa=replicate
+				rndenv evil(evil_args, environment.get()); // only the state of its games
+				for (size_t g; !stop && (g = next++) < total; ) {
+					for (size_t c = 0; c < candidates.size(); c++) play(*candidates[c], evil, g, c);
+					finish(g);
+				}
+			});
+		}
+		for (std::thread& worker : workers) worker.join();
+		summary();
+		environment.reset(); // saves the book the workers recorded (book= openings=), once
+	}
+
+private:
+	void play(player& who, rndenv& evil, size_t g, size_t c) {
+		evil.reseed(g);
+		evil.reset();
+		episode game;
+		while (true) {
+			action move;
+			if (std::max(game.step(), size_t(8)) % 2) {
+				board temp = game.state();
+				temp.hint = (evil.now > 3) ? 4 : evil.now;
+				temp.bag = evil.bag;
+				float value;
+				int op = who.decide(temp, value);
+				if (op != -1) move = action::slide(op);
+			} else {
+				move = evil.take_action(game.state());
+			}
+			if (game.apply_action(move) != true) break;
+		}
+		score[c][g] = game.score();
+		tile[c][g] = *std::max_element(&(game.state()(0)), &(game.state()(16)));
+	}
+
+	/**
+	 * record game g as done; the games are reported in order, so a block
+	 * is shown once its games and all games before them are done
+	 */
+	void finish(size_t g) {
+		std::lock_guard<std::mutex> lock(mutex);
+		done[g] = true;
+		while (count < total && done[count]) {
+			if (++count % block == 0 && !stop) show(count, true);
+		}
+	}
+
+	struct estimate {
+		double mean, half;
+	};
+	static estimate interval(const std::vector<double>& x, double z) {
+		double mean = std::accumulate(x.begin(), x.end(), 0.0) / x.size();
+		double var = 0;
+		for (double v : x) var += (v - mean) * (v - mean);
+		var = (x.size() > 1) ? var / (x.size() - 1) : 0;
+		return { mean, z * std::sqrt(var / x.size()) };
+	}
+
+	/**
+	 * show the first 'n' games, return whether all comparisons are decided
+	 */
+	bool show(size_t n, bool early) {
+		bool decided = candidates.size() > 1;
+		std::ios ff(nullptr);
+		ff.copyfmt(std::cout);
+		std::cout << std::fixed << std::setprecision(0);
+		for (size_t c = 0; c < candidates.size(); c++) {
+			std::vector<double> x(score[c].begin(), score[c].begin() + n), diff(n);
+			estimate s = interval(x, 1.96);
+			std::cout << (c ? "" : std::to_string(n)) << "\t" << names[c] << "\t";
+			std::cout << "avg = " << s.mean << " +- " << s.half << ", ";
+			std::cout << "max = " << *std::max_element(x.begin(), x.end());
+			if (c) {
+				for (size_t g = 0; g < n; g++) diff[g] = score[c][g] - score[0][g];
+				estimate d = interval(diff, 1.96), strict = interval(diff, 3);
+				bool clear = std::abs(strict.mean) > strict.half;
+				decided &= clear;
+				std::cout << ", diff = " << std::showpos << d.mean << std::noshowpos << " +- " << d.half;
+				if (clear) std::cout << (d.mean > 0 ? " (better)" : " (worse)");
+			}
+			std::cout << std::endl;
+		}
+		std::cout.copyfmt(ff);
+		if (early && decided && n >= 30 && n < total) {
+			stop = true;
+			std::cout << "decided after " << n << " games" << std::endl;
+		}
+		return decided;
+	}
+
+	void summary() {
+		std::cout << std::endl;
+		if (count % block) show(count, false);
+		for (size_t c = 0; c < candidates.size(); c++) {
+			size_t stat[16] = { 0 };
+			for (size_t g = 0; g < count; g++) stat[tile[c][g] & 15]++;
+			std::cout << names[c] << std::endl;
+			for (size_t t = 0, k = 0; k < count; k += stat[t++]) {
+				if (stat[t] == 0) continue;
+				unsigned accu = std::accumulate(std::begin(stat) + t, std::end(stat), 0);
+				int v = (t > 3) ? (1 << (t-3) & -2u)*3 : t;
+				std::cout << "\t" << v; // type
+				std::cout << "\t" << (accu * 100.0 / count) << "%"; // win rate
+				std::cout << "\t" "(" << (stat[t] * 100.0 / count) << "%" ")"; // percentage of ending
+				std::cout << std::endl;
+			}
+		}
+		std::cout << std::endl;
+	}
+
+private:
+	std::vector<std::string> names;
+	std::vector<std::unique_ptr<player>> candidates;
+	std::unique_ptr<rndenv> environment; // the tables the environments of the workers read
+	std::string evil_args;
+	size_t total;
+	size_t block;
+	size_t threads;
+	std::vector<std::vector<int>> score;
+	std::vector<std::vector<int>> tile;
+	std::vector<bool> done;
+	size_t count = 0;
+	std::atomic<bool> stop{false};
+	std::mutex mutex;
+};
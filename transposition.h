@@ -0,0 +1,115 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <cstring>
+#include <cmath>
+#include "board.h"
+#include "rng.h"
+
+/**
+ * transposition table for the alpha-beta search of the environment
+ *
+ * entries survive between moves of an episode, so the subtree reached two
+ * plies later is found again with its value bounds and best move; each entry
+ * records the search generation that wrote it, and entries of older
+ * generations are the first to be replaced
+ *
+ * an entry is two 64-bit words, the hash xor the data and the data, written
+ * without locks; a torn entry no longer matches its hash and reads as a miss
+ */
+class transposition {
+public:
+	enum bound { exact, lower, upper };
+
+	struct entry {
+		float value;
+		int depth;
+		bound type;
+		int move; // the best slide of a player node, or the best position of an environment node
+		int age;
+	};
+
+public:
+	transposition() : mask(0), generation(0) {}
+
+	/**
+	 * allocate 2^n entries fitting in 'mb' megabytes (0 disables the table)
+	 */
+	void resize(size_t mb) {
+		size_t count = 0;
+		for (size_t n = 1; n * 16 <= mb << 20; n <<= 1) count = n;
+		table.reset(count ? new slot[count] : nullptr);
+		mask = count ? count - 1 : 0;
+		clear();
+	}
+	bool enabled() const { return table != nullptr; }
+
+	void clear() {
+		for (size_t i = 0; table && i <= mask; i++) {
+			table[i].check.store(0, std::memory_order_relaxed);
+			table[i].data.store(0, std::memory_order_relaxed);
+		}
+		generation = 0;
+	}
+
+	/**
+	 * start a new search; older entries become preferred victims
+	 */
+	void age() { generation = (generation + 1) & 0xff; }
+
+	uint64_t hash(const board& b, bool bonus) const {
+		const std::array<std::array<uint64_t, 16>, 16>& cell = zobrist();
+		uint64_t h = 0;
+		for (int i = 0; i < 16; i++) h ^= cell[i][b(i) & 15];
+		uint64_t state = uint64_t(b.type == 'b') | uint64_t(b.hint & 15) << 1 | uint64_t(b.last + 1) << 5
+			| uint64_t(b.max & 15) << 8 | uint64_t(bonus) << 12
+			| uint64_t(b.bag[0] & 15) << 16 | uint64_t(b.bag[1] & 15) << 20 | uint64_t(b.bag[2] & 15) << 24;
+		return h ^ rng(state, 0x7474)();
+	}
+
+	bool probe(uint64_t hash, entry& e) const {
+		const slot& s = table[hash & mask];
+		uint64_t data = s.data.load(std::memory_order_relaxed);
+		if ((s.check.load(std::memory_order_relaxed) ^ data) != hash || data == 0) return false;
+		uint32_t bits = uint32_t(data);
+		std::memcpy(&e.value, &bits, sizeof(float));
+		e.depth = (data >> 32) & 0xff;
+		e.type = bound((data >> 40) & 0x3);
+		e.move = int((data >> 48) & 0xff) - 1;
+		e.age = (data >> 56) & 0xff;
+		return true;
+	}
+
+	void store(uint64_t hash, float value, int depth, bound type, int move) {
+		slot& s = table[hash & mask];
+		uint64_t old = s.data.load(std::memory_order_relaxed);
+		if (old && int((old >> 56) & 0xff) == generation && int((old >> 32) & 0xff) > depth) return;
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(float));
+		uint64_t data = uint64_t(bits) | uint64_t(depth & 0xff) << 32 | uint64_t(type) << 40
+			| uint64_t((move + 1) & 0xff) << 48 | uint64_t(generation) << 56;
+		s.check.store(hash ^ data, std::memory_order_relaxed);
+		s.data.store(data, std::memory_order_relaxed);
+	}
+
+private:
+	struct slot {
+		std::atomic<uint64_t> check;
+		std::atomic<uint64_t> data;
+	};
+
+	static const std::array<std::array<uint64_t, 16>, 16>& zobrist() {
+		static std::array<std::array<uint64_t, 16>, 16> keys = generate();
+		return keys;
+	}
+	static std::array<std::array<uint64_t, 16>, 16> generate() {
+		std::array<std::array<uint64_t, 16>, 16> keys;
+		rng engine(0x2048);
+		for (auto& cell : keys) for (auto& key : cell) key = engine();
+		return keys;
+	}
+
+	std::unique_ptr<slot[]> table;
+	size_t mask;
+	int generation;
+};
@@ -11,36 +11,205 @@
 #include <iostream>
 #include <vector>
 #include <utility>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
 
+/**
+ * weight table backed by anonymous mmap
+ *
+ * the backing pages can be selected per table:
+ *  small: regular 4 KB pages
+ *  thp:   transparent huge pages via madvise(MADV_HUGEPAGE)
+ *  2m/1g: explicit huge pages via MAP_HUGETLB, falls back to thp if the
+ *         hugetlb pool cannot satisfy the request
+ * a table may also be bound to a numa node before its pages are touched
+ *
+ * a table can instead be backed by a file (shared mapping), so that its pages
+ * are read on demand and written back by the kernel, and can be evicted under
+ * memory pressure; the file is truncated to zero when the table is allocated
+ *
+ * a table may also be a view of memory owned elsewhere (e.g. a segment), which
+ * is never unmapped or reallocated by the table
+ */
 class weight {
 public:
-	weight() {}
-	weight(size_t len) : value(len) {}
-	weight(weight&& f) : value(std::move(f.value)) {}
-	weight(const weight& f) = default;
+	enum page { small, thp, huge_2m, huge_1g };
+
+	static page page_of(const std::string& name) {
+		if (name == "thp") return thp;
+		if (name == "2m" || name == "2M") return huge_2m;
+		if (name == "1g" || name == "1G") return huge_1g;
+		return small;
+	}
+
+public:
+	weight(page mode = small, int node = -1) : value(nullptr), length(0), mapped(0), mode(mode), node(node) {}
+	weight(size_t len, page mode = small, int node = -1) : weight(mode, node) { resize(len); }
+	weight(size_t len, const std::string& path) : weight() { file = path; resize(len); }
+	weight(float* view, size_t len) : weight() { value = view; length = len; mapped = (len * sizeof(float) + 4095) / 4096 * 4096; borrowed = true; }
+	weight(weight&& f) noexcept : weight() { swap(f); } // noexcept, so a growing vector moves its tables rather than copying them
+	weight(const weight& f) : weight(f.mode, f.node) { operator =(f); }
+	~weight() { release(); }
 
-	weight& operator =(const weight& f) = default;
+	weight& operator =(const weight& f) {
+		if (this == &f) return *this;
+		resize(f.length);
+		std::memcpy(value, f.value, sizeof(float) * length);
+		return *this;
+	}
+	weight& operator =(weight&& f) noexcept { swap(f); return *this; }
 	float& operator[] (size_t i) { return value[i]; }
 	const float& operator[] (size_t i) const { return value[i]; }
-	size_t size() const { return value.size(); }
+	size_t size() const { return length; }
+	bool backed() const { return file.size(); } // by a file rather than anonymous memory
+	float* data() { return value; }
+	const float* data() const { return value; }
+
+	/**
+	 * reallocate the table with the same page mode and node, new entries are zero
+	 */
+	void resize(size_t len) {
+		if (len == length) return;
+		if (borrowed) {
+			std::cerr << "weight: a view of " << length << " entries cannot hold " << len << std::endl;
+			std::exit(-1);
+		}
+		release();
+		if (len == 0) return;
+		value = static_cast<float*>(allocate(sizeof(float) * len));
+		length = len;
+	}
+
+	/**
+	 * the bytes of the table currently resident in memory (by mincore)
+	 */
+	size_t resident() const {
+		if (!value) return 0;
+		size_t page = sysconf(_SC_PAGESIZE), count = 0;
+		std::vector<unsigned char> core(1 << 16);
+		for (size_t from = 0; from < mapped; from += core.size() * page) {
+			size_t len = std::min(mapped - from, core.size() * page);
+			if (mincore(reinterpret_cast<char*>(value) + from, len, core.data()) != 0) return 0;
+			for (size_t i = 0; i < (len + page - 1) / page; i++) count += core[i] & 1;
+		}
+		return count * page;
+	}
+
+	/**
+	 * copy 'f' (of the same size) page by page, skipping the pages that are
+	 * zero in both, so that pages never touched stay unallocated
+	 */
+	void copy_sparse(const weight& f) {
+		const size_t block = 4096 / sizeof(float);
+		for (size_t i = 0; i < std::min(length, f.length); i += block) {
+			size_t n = std::min(block, std::min(length, f.length) - i);
+			const float* from = f.value + i;
+			if (std::all_of(from, from + n, [](float v) { return v == 0; })
+				&& std::all_of(value + i, value + i + n, [](float v) { return v == 0; })) continue;
+			std::memcpy(value + i, from, sizeof(float) * n);
+		}
+	}
+
+	/**
+	 * move entry i to 'order(i)' for every i, where 'order' is a permutation
+	 * of the entries; only the non-zero entries are moved (into a fresh
+	 * anonymous table), so that pages never touched stay unallocated
+	 */
+	template<typename map>
+	void permute(map order) {
+		weight fresh(file.size() ? small : mode, node);
+		fresh.resize(length);
+		const uint32_t* bits = reinterpret_cast<const uint32_t*>(value);
+		for (size_t i = 0; i < length; i++) if (bits[i]) fresh.value[order(i)] = value[i];
+		if (borrowed || file.size()) copy_sparse(fresh);
+		else swap(fresh);
+	}
+
+	void swap(weight& f) {
+		std::swap(value, f.value);
+		std::swap(length, f.length);
+		std::swap(mapped, f.mapped);
+		std::swap(mode, f.mode);
+		std::swap(node, f.node);
+		std::swap(file, f.file);
+		std::swap(borrowed, f.borrowed);
+	}
 
 public:
 	friend std::ostream& operator <<(std::ostream& out, const weight& w) {
-		auto& value = w.value;
-		uint64_t size = value.size();
+		uint64_t size = w.length;
 		out.write(reinterpret_cast<const char*>(&size), sizeof(uint64_t));
-		out.write(reinterpret_cast<const char*>(value.data()), sizeof(float) * size);
+		out.write(reinterpret_cast<const char*>(w.value), sizeof(float) * size);
 		return out;
 	}
 	friend std::istream& operator >>(std::istream& in, weight& w) {
-		auto& value = w.value;
 		uint64_t size = 0;
 		in.read(reinterpret_cast<char*>(&size), sizeof(uint64_t));
-		value.resize(size);
-		in.read(reinterpret_cast<char*>(value.data()), sizeof(float) * size);
+		w.resize(size);
+		in.read(reinterpret_cast<char*>(w.value), sizeof(float) * size);
 		return in;
 	}
 
 protected:
-	std::vector<float> value;
+	void* allocate(size_t bytes) {
+		size_t align = (mode == huge_1g) ? (1ul << 30) : (mode == small) ? 4096 : (1ul << 21);
+		mapped = (bytes + align - 1) / align * align;
+		void* ptr = MAP_FAILED;
+		if (file.size()) {
+			mapped = (bytes + 4095) / 4096 * 4096;
+			int fd = open(file.c_str(), O_RDWR | O_CREAT, 0644);
+			if (fd < 0 || ftruncate(fd, 0) != 0 || ftruncate(fd, mapped) != 0) {
+				std::cerr << "weight: cannot back a table by " << file << std::endl;
+				std::exit(-1);
+			}
+			ptr = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			close(fd);
+			if (ptr == MAP_FAILED) throw std::bad_alloc();
+			madvise(ptr, mapped, MADV_RANDOM); // a lookup touches one entry, read-ahead would only waste memory
+			return ptr;
+		}
+		if (mode == huge_2m || mode == huge_1g) {
+			int huge = (mode == huge_1g) ? (30 << MAP_HUGE_SHIFT) : (21 << MAP_HUGE_SHIFT);
+			ptr = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | huge, -1, 0);
+			if (ptr == MAP_FAILED) {
+				std::cerr << "weight: hugetlb pages unavailable, falling back to thp" << std::endl;
+				mode = thp;
+				mapped = (bytes + (1ul << 21) - 1) >> 21 << 21;
+			}
+		}
+		if (ptr == MAP_FAILED) {
+			ptr = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (ptr == MAP_FAILED) throw std::bad_alloc();
+			if (mode == thp) madvise(ptr, mapped, MADV_HUGEPAGE);
+		}
+		if (node >= 0) {
+			unsigned long mask[16] = { 0 };
+			mask[node / 64] |= 1ul << (node % 64);
+			syscall(SYS_mbind, ptr, mapped, MPOL_BIND, mask, sizeof(mask) * 8, 0);
+		}
+		return ptr;
+	}
+	void release() {
+		if (value && !borrowed) munmap(value, mapped);
+		value = nullptr;
+		length = 0;
+		mapped = 0;
+		borrowed = false;
+	}
+
+protected:
+	float* value;
+	size_t length;
+	size_t mapped;
+	page mode;
+	int node;
+	std::string file;
+	bool borrowed = false;
 };